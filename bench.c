@@ -0,0 +1,346 @@
+/* This file is part of mali-fbdev-ioctl.
+ * Copyright (C) 2014-2015 - Tobias Jakobi
+ *
+ * mali-fbdev-ioctl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * mali-fbdev-ioctl is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mali-fbdev-ioctl. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Overhead of the interposed open/close/ioctl/mmap/munmap calls.
+ *
+ * Run it with one of the preloaders (LD_PRELOAD=./hook.so ./bench). Each
+ * call is timed through the preloader and directly through libc, for an
+ * unrelated fd and for the fbdev and mali devices. Without the devices the
+ * fbdev file of hook.so (/dev/shm/fake_fbdev) stands in, mali is skipped. */
+
+#include "common.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+enum {
+  max_threads = 64,
+  map_size = 4096,
+
+  default_iterations = 200000,
+  /* open/close of the devices is much slower. */
+  open_divisor = 10
+};
+
+struct calls {
+  const char *name;
+
+  openfnc open;
+  closefnc close;
+  ioctlfnc ioctl;
+  mmapfnc mmap;
+  munmapfnc munmap;
+};
+
+struct target {
+  const char *name;
+
+  const char *path; /* opened through the preloader */
+  const char *libc_path; /* opened through libc */
+  int fd;
+
+  int map_fd;
+  int map_flags;
+
+  bool threaded; /* the hook keeps a single fbdev/mali state */
+};
+
+struct bench_case {
+  const char *name;
+  void (*run)(const struct calls *c, const struct target *t, unsigned n);
+
+  unsigned divisor;
+  bool threaded; /* safe to run concurrently on every target */
+};
+
+struct bench_thread {
+  pthread_t thread;
+  pthread_barrier_t *barrier;
+
+  const struct calls *calls;
+  const struct target *target;
+  const struct bench_case *bcase;
+  unsigned iterations;
+
+  uint64_t elapsed;
+};
+
+static struct calls libc_calls = {
+  .name = "libc"
+};
+
+static struct calls wrapped_calls = {
+  .name = "wrapped",
+
+  .open = (openfnc)open,
+  .close = close,
+  .ioctl = ioctl,
+  .mmap = mmap,
+  .munmap = munmap
+};
+
+static uint64_t get_time_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void run_open_close(const struct calls *c, const struct target *t, unsigned n) {
+  const char *path = (c == &libc_calls) ? t->libc_path : t->path;
+  unsigned i;
+
+  for (i = 0; i < n; ++i) {
+    const int fd = c->open(path, O_RDWR, 0);
+
+    if (fd >= 0)
+      c->close(fd);
+  }
+}
+
+static void run_ioctl(const struct calls *c, const struct target *t, unsigned n) {
+  struct fb_var_screeninfo var;
+  unsigned i;
+
+  for (i = 0; i < n; ++i)
+    c->ioctl(t->fd, FBIOGET_VSCREENINFO, &var);
+}
+
+static void run_mmap(const struct calls *c, const struct target *t, unsigned n) {
+  unsigned i;
+
+  for (i = 0; i < n; ++i) {
+    void *p = c->mmap(NULL, map_size, PROT_WRITE, t->map_flags, t->map_fd, 0);
+
+    if (p != MAP_FAILED && p != NULL)
+      c->munmap(p, map_size);
+  }
+}
+
+static const struct bench_case bench_cases[] = {
+  { "open+close", run_open_close, open_divisor, false },
+  { "ioctl", run_ioctl, 1, true },
+  { "mmap+munmap", run_mmap, 1, false }
+};
+
+static const unsigned num_bench_cases = sizeof(bench_cases) / sizeof(bench_cases[0]);
+
+static void *bench_thread(void *arg) {
+  struct bench_thread *bt = arg;
+  uint64_t start;
+
+  pthread_barrier_wait(bt->barrier);
+
+  start = get_time_ns();
+  bt->bcase->run(bt->calls, bt->target, bt->iterations);
+  bt->elapsed = get_time_ns() - start;
+
+  return NULL;
+}
+
+/* Time a case on a number of threads, returns the average ns/call. */
+static double bench_run(const struct calls *c, const struct target *t,
+                        const struct bench_case *bc, unsigned threads,
+                        unsigned iterations) {
+  struct bench_thread bt[max_threads];
+  pthread_barrier_t barrier;
+  uint64_t elapsed = 0;
+  unsigned i;
+
+  /* Warm up, e.g. the lazy binding of the preloader. */
+  bc->run(c, t, iterations / 100 + 1);
+
+  pthread_barrier_init(&barrier, NULL, threads);
+
+  for (i = 0; i < threads; ++i) {
+    bt[i].barrier = &barrier;
+    bt[i].calls = c;
+    bt[i].target = t;
+    bt[i].bcase = bc;
+    bt[i].iterations = iterations;
+    bt[i].elapsed = 0;
+
+    if (i > 0 && pthread_create(&bt[i].thread, NULL, bench_thread, &bt[i])) {
+      fprintf(stderr, "[bench_run] error: failed to create thread\n");
+      exit(1);
+    }
+  }
+
+  bench_thread(&bt[0]);
+
+  for (i = 1; i < threads; ++i)
+    pthread_join(bt[i].thread, NULL);
+
+  pthread_barrier_destroy(&barrier);
+
+  for (i = 0; i < threads; ++i)
+    elapsed += bt[i].elapsed;
+
+  return (double)elapsed / threads / iterations;
+}
+
+static bool bind_libc() {
+  void *handle = dlopen("libc.so.6", RTLD_LAZY | RTLD_NOLOAD);
+
+  if (!handle) {
+    fprintf(stderr, "[bind_libc] error: libc not loaded\n");
+    return false;
+  }
+
+  libc_calls.open = (openfnc)dlsym(handle, "open");
+  libc_calls.close = (closefnc)dlsym(handle, "close");
+  libc_calls.ioctl = (ioctlfnc)dlsym(handle, "ioctl");
+  libc_calls.mmap = (mmapfnc)dlsym(handle, "mmap");
+  libc_calls.munmap = (munmapfnc)dlsym(handle, "munmap");
+
+  return libc_calls.open && libc_calls.close && libc_calls.ioctl &&
+         libc_calls.mmap && libc_calls.munmap;
+}
+
+static bool open_target(struct target *t) {
+  t->fd = wrapped_calls.open(t->path, O_RDWR, 0);
+
+  /* Fall back to the stand-in, if the path isn't hooked. */
+  if (t->fd < 0 && t->libc_path != t->path) {
+    t->path = t->libc_path;
+    t->fd = wrapped_calls.open(t->path, O_RDWR, 0);
+  }
+
+  if (t->fd < 0)
+    return false;
+
+  if (t->map_fd != -1)
+    t->map_fd = t->fd;
+
+  return true;
+}
+
+static void bench_target(struct target *t, unsigned threads, unsigned iterations) {
+  unsigned i;
+
+  if (!open_target(t)) {
+    printf("%-6s skipped (%s: %s)\n", t->name, t->path, strerror(errno));
+    return;
+  }
+
+  for (i = 0; i < num_bench_cases; ++i) {
+    const struct bench_case *bc = &bench_cases[i];
+    const unsigned n = iterations / bc->divisor;
+    double libc_1, wrapped_1;
+
+    libc_1 = bench_run(&libc_calls, t, bc, 1, n);
+    wrapped_1 = bench_run(&wrapped_calls, t, bc, 1, n);
+
+    printf("%-6s %-12s %8.1f %8.1f %+8.1f", t->name, bc->name,
+           libc_1, wrapped_1, wrapped_1 - libc_1);
+
+    if (threads > 1 && (bc->threaded || t->threaded)) {
+      const double libc_n = bench_run(&libc_calls, t, bc, threads, n);
+      const double wrapped_n = bench_run(&wrapped_calls, t, bc, threads, n);
+
+      /* Scaling: 1.00 means the calls don't slow each other down. */
+      printf(" %8.1f %8.1f %6.2f %6.2f", libc_n, wrapped_n,
+             libc_1 / libc_n, wrapped_1 / wrapped_n);
+    }
+
+    printf("\n");
+  }
+
+  wrapped_calls.close(t->fd);
+}
+
+int main(int argc, char *argv[]) {
+  unsigned threads = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned iterations = default_iterations;
+  int opt, fd, null_stderr, saved_stderr;
+
+  struct target targets[] = {
+    { "other", "/dev/null", "/dev/null", -1, -1, MAP_SHARED | MAP_ANONYMOUS, true },
+    { "fbdev", fbdev_name, fake_fbdev, -1, 0, MAP_SHARED, false },
+    /* Mapping mali memory needs a cookie, so only the dispatch is timed. */
+    { "mali", mali_name, mali_name, -1, -1, MAP_SHARED | MAP_ANONYMOUS, false }
+  };
+  unsigned i;
+
+  while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+    switch (opt) {
+      case 't':
+        threads = strtoul(optarg, NULL, 0);
+        break;
+
+      case 'n':
+        iterations = strtoul(optarg, NULL, 0);
+        break;
+
+      default:
+        fprintf(stderr, "usage: %s [-t threads] [-n iterations]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if (threads < 1)
+    threads = 1;
+
+  if (threads > max_threads)
+    threads = max_threads;
+
+  if (iterations < open_divisor)
+    iterations = open_divisor;
+
+  if (!bind_libc())
+    return 1;
+
+  /* The stand-in for the fbdev device. */
+  fd = libc_calls.open(fake_fbdev, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "[main] error: failed to create %s\n", fake_fbdev);
+    return 1;
+  }
+
+  libc_calls.close(fd);
+
+  printf("preload: %s\n", getenv("LD_PRELOAD") ? getenv("LD_PRELOAD") : "none");
+  printf("%u iterations, %u threads, ns/call\n\n", iterations, threads);
+  printf("%-6s %-12s %8s %8s %8s %8s %8s %6s %6s\n", "target", "call",
+         "libc", "wrapped", "delta", "libc/mt", "wrap/mt", "scale", "scale");
+
+  /* The preloaders log the device calls, keep that out of the way. */
+  fflush(stderr);
+  saved_stderr = dup(2);
+  null_stderr = libc_calls.open("/dev/null", O_WRONLY, 0);
+  dup2(null_stderr, 2);
+  libc_calls.close(null_stderr);
+
+  for (i = 0; i < sizeof(targets) / sizeof(targets[0]); ++i) {
+    bench_target(&targets[i], threads, iterations);
+    fflush(stdout);
+  }
+
+  dup2(saved_stderr, 2);
+  libc_calls.close(saved_stderr);
+
+  return 0;
+}
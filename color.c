@@ -0,0 +1,237 @@
+/* This file is part of mali-fbdev-ioctl.
+ * Copyright (C) 2014-2015 - Tobias Jakobi
+ *
+ * mali-fbdev-ioctl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * mali-fbdev-ioctl is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mali-fbdev-ioctl. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "color.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+
+enum e_color_section {
+  section_none = 0,
+  section_degamma,
+  section_ctm,
+  section_gamma
+};
+
+enum {
+  max_lut_size = 4096
+};
+
+static uint16_t to_lut_value(double v) {
+  if (v <= 0.0)
+    return 0;
+
+  if (v >= 1.0)
+    return 0xffff;
+
+  return (uint16_t)(v * 65535.0 + 0.5);
+}
+
+static uint64_t to_ctm_value(double v) {
+  const uint64_t sign = (v < 0.0) ? (1ull << 63) : 0;
+  const double max = (double)(1ull << 31);
+
+  if (v < 0.0)
+    v = -v;
+
+  if (v >= max)
+    v = max - 1.0;
+
+  return sign | (uint64_t)(v * 4294967296.0 + 0.5);
+}
+
+int color_load(const char *path, struct color_calibration *cal) {
+  enum e_color_section section = section_none;
+  unsigned expected = 0, count = 0;
+  unsigned line = 0;
+  const char *error = NULL;
+  char buf[256];
+  FILE *f;
+
+  memset(cal, 0, sizeof(struct color_calibration));
+
+  f = fopen(path, "r");
+  if (!f) {
+    fprintf(stderr, "[color_load] error: failed to open calibration file %s\n", path);
+    return -1;
+  }
+
+  while (fgets(buf, sizeof(buf), f)) {
+    char word[16], *comment;
+    double v[3];
+    unsigned i, n;
+
+    ++line;
+
+    comment = strchr(buf, '#');
+    if (comment)
+      *comment = '\0';
+
+    if (sscanf(buf, "%15s", word) != 1)
+      continue;
+
+    if (isalpha((unsigned char)word[0])) {
+      if (count != expected) {
+        error = "previous section is incomplete";
+        goto fail;
+      }
+
+      count = 0;
+
+      if (strcmp(word, "ctm") == 0) {
+        if (cal->ctm) {
+          error = "duplicate ctm section";
+          goto fail;
+        }
+
+        cal->ctm = calloc(1, sizeof(struct drm_color_ctm));
+        if (!cal->ctm) {
+          error = "out of memory";
+          goto fail;
+        }
+
+        section = section_ctm;
+        expected = 3;
+      } else if (strcmp(word, "degamma") == 0 || strcmp(word, "gamma") == 0) {
+        const bool gamma = (word[0] == 'g');
+        struct drm_color_lut **lut = gamma ? &cal->gamma : &cal->degamma;
+
+        if (*lut) {
+          error = "duplicate lut section";
+          goto fail;
+        }
+
+        if (sscanf(buf, "%*s %u", &n) != 1 || n < 2 || n > max_lut_size) {
+          error = "invalid lut size";
+          goto fail;
+        }
+
+        *lut = calloc(n, sizeof(struct drm_color_lut));
+        if (!*lut) {
+          error = "out of memory";
+          goto fail;
+        }
+
+        if (gamma)
+          cal->gamma_size = n;
+        else
+          cal->degamma_size = n;
+
+        section = gamma ? section_gamma : section_degamma;
+        expected = n;
+      } else {
+        error = "unknown section";
+        goto fail;
+      }
+
+      continue;
+    }
+
+    if (section == section_none || count == expected) {
+      error = "unexpected data";
+      goto fail;
+    }
+
+    if (sscanf(buf, "%lf %lf %lf", &v[0], &v[1], &v[2]) != 3) {
+      error = "expected three values";
+      goto fail;
+    }
+
+    if (section == section_ctm) {
+      for (i = 0; i < 3; ++i)
+        cal->ctm->matrix[count * 3 + i] = to_ctm_value(v[i]);
+    } else {
+      struct drm_color_lut *lut = (section == section_gamma) ? cal->gamma : cal->degamma;
+
+      lut[count].red = to_lut_value(v[0]);
+      lut[count].green = to_lut_value(v[1]);
+      lut[count].blue = to_lut_value(v[2]);
+    }
+
+    ++count;
+  }
+
+  if (count != expected) {
+    error = "last section is incomplete";
+    goto fail;
+  }
+
+  fclose(f);
+  return 0;
+
+fail:
+  fprintf(stderr, "[color_load] error: %s:%u: %s\n", path, line, error);
+
+  fclose(f);
+  color_free(cal);
+
+  return -1;
+}
+
+void color_free(struct color_calibration *cal) {
+  free(cal->degamma);
+  free(cal->ctm);
+  free(cal->gamma);
+
+  memset(cal, 0, sizeof(struct color_calibration));
+}
+
+static uint16_t lerp(uint16_t a, uint16_t b, double t) {
+  return (uint16_t)((double)a + ((double)b - (double)a) * t + 0.5);
+}
+
+struct drm_color_lut *color_resample_lut(const struct drm_color_lut *lut,
+                                         unsigned size, unsigned new_size) {
+  struct drm_color_lut *out;
+  unsigned i;
+
+  if (size < 2 || new_size < 2)
+    return NULL;
+
+  out = malloc(new_size * sizeof(struct drm_color_lut));
+  if (!out)
+    return NULL;
+
+  for (i = 0; i < new_size; ++i) {
+    const double pos = (double)i * (size - 1) / (new_size - 1);
+    unsigned idx = (unsigned)pos;
+    double t = pos - idx;
+
+    if (idx >= size - 1) {
+      idx = size - 2;
+      t = 1.0;
+    }
+
+    out[i].red = lerp(lut[idx].red, lut[idx + 1].red, t);
+    out[i].green = lerp(lut[idx].green, lut[idx + 1].green, t);
+    out[i].blue = lerp(lut[idx].blue, lut[idx + 1].blue, t);
+    out[i].reserved = 0;
+  }
+
+  return out;
+}
+
+void color_ctm_from_matrix(struct drm_color_ctm *ctm, const double *matrix) {
+  unsigned i;
+
+  for (i = 0; i < 9; ++i)
+    ctm->matrix[i] = to_ctm_value(matrix[i]);
+}
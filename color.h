@@ -0,0 +1,53 @@
+/* This file is part of mali-fbdev-ioctl.
+ * Copyright (C) 2014-2015 - Tobias Jakobi
+ *
+ * mali-fbdev-ioctl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * mali-fbdev-ioctl is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mali-fbdev-ioctl. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _COLOR_H_
+#define _COLOR_H_
+
+#include <xf86drmMode.h>
+
+/* Colour calibration of a display, applied by the CRTC (degamma LUT,
+ * colour transformation matrix, gamma LUT). Missing parts are NULL. */
+struct color_calibration {
+  struct drm_color_lut *degamma;
+  unsigned degamma_size;
+
+  struct drm_color_ctm *ctm;
+
+  struct drm_color_lut *gamma;
+  unsigned gamma_size;
+};
+
+/* Load a calibration file.
+ *
+ * The file consists of up to three sections:
+ *   degamma <n>  followed by n lines "r g b" with values from 0.0 to 1.0
+ *   ctm          followed by 3 lines with one row of the matrix each
+ *   gamma <n>    followed by n lines "r g b" with values from 0.0 to 1.0
+ * Everything after a '#' is a comment. */
+int color_load(const char *path, struct color_calibration *cal);
+
+void color_free(struct color_calibration *cal);
+
+/* Linearly resample a LUT to a different number of entries. */
+struct drm_color_lut *color_resample_lut(const struct drm_color_lut *lut,
+                                         unsigned size, unsigned new_size);
+
+/* Convert a row-major 3x3 matrix into the S31.32 sign-magnitude format. */
+void color_ctm_from_matrix(struct drm_color_ctm *ctm, const double *matrix);
+
+#endif /* _COLOR_H_ */
@@ -19,6 +19,7 @@
 #define _COMMON_H_
 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <dlfcn.h>
 
@@ -55,11 +56,20 @@ struct exynos_page;
 struct exynos_fliphandler;
 struct exynos_drm;
 
+/* Statistics of the hook, see hook_get_stats(). */
+struct hook_stats {
+  unsigned skipped_frames; /* pans skipped because nothing was rendered */
+  unsigned flip_timeouts; /* flip events that didn't arrive in time */
+  unsigned flip_recoveries; /* timed out flips that were redone successfully */
+  unsigned pp_jobs_in_flight; /* PP jobs submitted on the mali fd and not finished yet */
+};
+
 struct hook_data {
   /* file descriptors */
   int fbdev_fd;
   int mali_fd;
   int drm_fd;
+  unsigned drm_fd_shared; /* set once the application got drm_fd */
 
   /* hooked system calls */
   openfnc open;
@@ -70,6 +80,8 @@ struct hook_data {
 
   unsigned width;
   unsigned height;
+  unsigned virt_width; /* dimensions of one page, can be larger than the screen */
+  unsigned virt_height;
   unsigned pitch;
   unsigned bpp; /* bytes per pixel */
   unsigned size; /* size of one page */
@@ -88,6 +100,29 @@ struct hook_data {
   unsigned num_pages;
   struct exynos_page *cur_page; /* currently displayed page */
   unsigned pageflip_pending;
+
+  /* Vblank sequence and time (ns, CLOCK_MONOTONIC) of the last completed flip. */
+  unsigned flip_sequence;
+  uint64_t flip_time;
+
+  /* Swap interval requested through eglSwapInterval, -1 if never called. */
+  int swap_interval;
+
+  /* Maximum number of frames rendered ahead of the display, 0 for no limit. */
+  unsigned max_frames;
+
+  /* Refresh period of the video mode in ns, 0 if unknown. */
+  uint64_t refresh_period;
+
+  /* Delay the return from PAN_DISPLAY, so that the next frame finishes *
+   * rendering latch_margin (ns) before its vblank.                      */
+  unsigned late_latch;
+  uint64_t latch_margin;
+
+  /* Skip pans to pages that weren't rendered to since they were last shown. */
+  unsigned idle_skip;
+
+  struct hook_stats stats;
 };
 
 enum e_connector_type {
@@ -96,6 +131,29 @@ enum e_connector_type {
   connector_other
 };
 
+/* CPU caching attribute of allocated buffer objects. */
+enum e_bo_caching {
+  bo_caching_none = 0, /* uncached (default) */
+  bo_caching_wc, /* write-combine */
+  bo_caching_cached
+};
+
+/* How the refresh rate of the video mode is selected. */
+enum e_refresh_policy {
+  refresh_auto = 0, /* closest to refresh if given, else the preferred mode */
+  refresh_highest,
+  refresh_exact,
+  refresh_closest
+};
+
+/* Rotation of the primary plane, counter-clockwise like the DRM rotation property. */
+enum e_rotation {
+  rotation_0 = 0,
+  rotation_90,
+  rotation_180,
+  rotation_270
+};
+
 struct video_config {
   unsigned width;
   unsigned height;
@@ -103,10 +161,33 @@ struct video_config {
   unsigned num_buffers;
   unsigned use_screen;
   unsigned connector_type;
+  unsigned bo_caching;
+  unsigned bo_noncontig; /* only valid if the display controller is behind an IOMMU */
+  unsigned refresh; /* requested refresh rate in mHz */
+  unsigned refresh_policy;
+  unsigned allow_interlace;
+  unsigned virtual_width; /* page size for panning, defaults to the screen size */
+  unsigned virtual_height;
+  unsigned rotation;
+  unsigned reflect_x; /* applied before the rotation */
+  unsigned reflect_y;
+  char calibration[256]; /* path of a colour calibration file, see color.h */
+  unsigned swap_interval; /* flip at most every Nth vblank, 0 follows eglSwapInterval */
+  unsigned fps_cap; /* maximum frame rate in mHz, 0 disables the cap */
+  unsigned allow_tearing; /* swap interval 0 flips immediately */
+  unsigned front_buffer; /* render directly into the scanned out page */
+  unsigned scanout_phase; /* front buffer: release the renderer this far (in %) into the frame */
+  unsigned max_frames; /* maximum number of frames queued ahead of the display, 0 for no limit */
+  unsigned late_latch; /* start rendering as late as the measured render time allows */
+  unsigned latch_margin; /* late latch: safety margin in us, defaults to 2000 */
+  unsigned adaptive_buffering; /* switch between double and triple buffering at runtime */
+  unsigned idle_skip; /* don't flip to pages that weren't rendered to */
+  unsigned event_priority; /* SCHED_FIFO priority of the event thread, 0 keeps the default */
+  unsigned event_cpu_mask; /* CPUs the event thread may run on, 0 for no restriction */
 };
 
 typedef int (*hsetupfnc)(struct hook_data*);
-typedef int (*hflipfnc)(struct hook_data*, unsigned);
+typedef int (*hflipfnc)(struct hook_data*, unsigned, unsigned, unsigned);
 typedef int (*hbufferfnc)(struct hook_data*, unsigned);
 
 #ifdef _IN_PRELOADER_SOURCE
@@ -0,0 +1,351 @@
+/* This file is part of mali-fbdev-ioctl.
+ * Copyright (C) 2014-2015 - Tobias Jakobi
+ *
+ * mali-fbdev-ioctl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * mali-fbdev-ioctl is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mali-fbdev-ioctl. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <errno.h>
+
+static const char *default_config_file = "/etc/mali-hook.conf";
+static const char *env_prefix = "MALI_HOOK_";
+
+struct config_enum {
+  const char *name;
+  unsigned value;
+};
+
+enum e_config_type {
+  config_uint = 0,
+  config_bool,
+  config_enum,
+  config_mhz, /* decimal value in Hz, stored in mHz */
+  config_string
+};
+
+struct config_key {
+  const char *name;
+  size_t offset;
+  size_t size;
+  enum e_config_type type;
+  const struct config_enum *enums;
+};
+
+static const struct config_enum connector_enums[] = {
+  { "hdmi", connector_hdmi },
+  { "vga", connector_vga },
+  { "other", connector_other },
+  { NULL, 0 }
+};
+
+static const struct config_enum bo_caching_enums[] = {
+  { "none", bo_caching_none },
+  { "wc", bo_caching_wc },
+  { "cached", bo_caching_cached },
+  { NULL, 0 }
+};
+
+static const struct config_enum refresh_policy_enums[] = {
+  { "auto", refresh_auto },
+  { "highest", refresh_highest },
+  { "exact", refresh_exact },
+  { "closest", refresh_closest },
+  { NULL, 0 }
+};
+
+static const struct config_enum rotation_enums[] = {
+  { "0", rotation_0 },
+  { "90", rotation_90 },
+  { "180", rotation_180 },
+  { "270", rotation_270 },
+  { NULL, 0 }
+};
+
+#define CONFIG_KEY(name, type, enums) \
+  { #name, offsetof(struct video_config, name), \
+    sizeof(((struct video_config *)0)->name), type, enums }
+
+static const struct config_key config_keys[] = {
+  CONFIG_KEY(width, config_uint, NULL),
+  CONFIG_KEY(height, config_uint, NULL),
+  CONFIG_KEY(bpp, config_uint, NULL),
+  CONFIG_KEY(num_buffers, config_uint, NULL),
+  CONFIG_KEY(use_screen, config_bool, NULL),
+  CONFIG_KEY(connector_type, config_enum, connector_enums),
+  CONFIG_KEY(bo_caching, config_enum, bo_caching_enums),
+  CONFIG_KEY(bo_noncontig, config_bool, NULL),
+  CONFIG_KEY(refresh, config_mhz, NULL),
+  CONFIG_KEY(refresh_policy, config_enum, refresh_policy_enums),
+  CONFIG_KEY(allow_interlace, config_bool, NULL),
+  CONFIG_KEY(virtual_width, config_uint, NULL),
+  CONFIG_KEY(virtual_height, config_uint, NULL),
+  CONFIG_KEY(rotation, config_enum, rotation_enums),
+  CONFIG_KEY(reflect_x, config_bool, NULL),
+  CONFIG_KEY(reflect_y, config_bool, NULL),
+  CONFIG_KEY(calibration, config_string, NULL),
+  CONFIG_KEY(swap_interval, config_uint, NULL),
+  CONFIG_KEY(fps_cap, config_mhz, NULL),
+  CONFIG_KEY(allow_tearing, config_bool, NULL),
+  CONFIG_KEY(front_buffer, config_bool, NULL),
+  CONFIG_KEY(scanout_phase, config_uint, NULL),
+  CONFIG_KEY(max_frames, config_uint, NULL),
+  CONFIG_KEY(late_latch, config_bool, NULL),
+  CONFIG_KEY(latch_margin, config_uint, NULL),
+  CONFIG_KEY(adaptive_buffering, config_bool, NULL),
+  CONFIG_KEY(idle_skip, config_bool, NULL),
+  CONFIG_KEY(event_priority, config_uint, NULL),
+  CONFIG_KEY(event_cpu_mask, config_uint, NULL)
+};
+
+#undef CONFIG_KEY
+
+static const unsigned num_config_keys = sizeof(config_keys) / sizeof(config_keys[0]);
+
+static bool parse_uint(const char *str, unsigned *value) {
+  char *end;
+  unsigned long v;
+
+  errno = 0;
+  v = strtoul(str, &end, 0);
+
+  if (errno != 0 || end == str || *end != '\0')
+    return false;
+
+  *value = v;
+  return true;
+}
+
+static bool parse_bool(const char *str, unsigned *value) {
+  static const char *true_names[] = { "1", "yes", "true", "on" };
+  static const char *false_names[] = { "0", "no", "false", "off" };
+  unsigned i;
+
+  for (i = 0; i < sizeof(true_names) / sizeof(true_names[0]); ++i) {
+    if (strcasecmp(str, true_names[i]) == 0) {
+      *value = 1;
+      return true;
+    }
+
+    if (strcasecmp(str, false_names[i]) == 0) {
+      *value = 0;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static bool parse_enum(const char *str, const struct config_enum *enums, unsigned *value) {
+  for (; enums->name; ++enums) {
+    if (strcasecmp(str, enums->name) == 0) {
+      *value = enums->value;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* Parse e.g. "59.94" into 59940. */
+static bool parse_mhz(const char *str, unsigned *value) {
+  char *end;
+  double v;
+
+  errno = 0;
+  v = strtod(str, &end);
+
+  if (errno != 0 || end == str || *end != '\0' || v < 0.0)
+    return false;
+
+  *value = (unsigned)(v * 1000.0 + 0.5);
+  return true;
+}
+
+static const struct config_key *find_key(const char *name) {
+  unsigned i;
+
+  for (i = 0; i < num_config_keys; ++i) {
+    if (strcasecmp(name, config_keys[i].name) == 0)
+      return &config_keys[i];
+  }
+
+  return NULL;
+}
+
+static void set_key(struct video_config *c, const struct config_key *key,
+                    const char *value, const char *origin) {
+  unsigned v;
+  bool ok;
+
+  if (key->type == config_string) {
+    if (strlen(value) >= key->size) {
+      fprintf(stderr, "[config] warning: value for %s too long (%s)\n", key->name, origin);
+      return;
+    }
+
+    strcpy((char *)c + key->offset, value);
+    return;
+  }
+
+  switch (key->type) {
+    case config_bool:
+      ok = parse_bool(value, &v);
+      break;
+
+    case config_enum:
+      ok = parse_enum(value, key->enums, &v);
+      break;
+
+    case config_mhz:
+      ok = parse_mhz(value, &v);
+      break;
+
+    case config_uint:
+    default:
+      ok = parse_uint(value, &v);
+      break;
+  }
+
+  if (!ok) {
+    fprintf(stderr, "[config] warning: invalid value \"%s\" for %s (%s)\n",
+            value, key->name, origin);
+    return;
+  }
+
+  *(unsigned *)((char *)c + key->offset) = v;
+}
+
+static char *strip(char *str) {
+  char *end;
+
+  while (isspace((unsigned char)*str))
+    ++str;
+
+  end = str + strlen(str);
+  while (end > str && isspace((unsigned char)end[-1]))
+    --end;
+
+  *end = '\0';
+
+  return str;
+}
+
+/* Apply the keys of one section of the config file. A section *
+ * name of NULL selects the keys before the first section.     */
+static void apply_file_section(struct video_config *c, FILE *f,
+                               const char *path, const char *section) {
+  char buf[256];
+  bool active = (section == NULL);
+  unsigned line = 0;
+
+  rewind(f);
+
+  while (fgets(buf, sizeof(buf), f)) {
+    const struct config_key *key;
+    char *str, *sep;
+
+    ++line;
+    str = strip(buf);
+
+    if (*str == '\0' || *str == '#' || *str == ';')
+      continue;
+
+    if (*str == '[') {
+      sep = strchr(str, ']');
+      if (sep)
+        *sep = '\0';
+
+      active = (section != NULL && strcmp(strip(str + 1), section) == 0);
+      continue;
+    }
+
+    if (!active)
+      continue;
+
+    sep = strchr(str, '=');
+    if (!sep) {
+      fprintf(stderr, "[config] warning: %s:%u: expected key = value\n", path, line);
+      continue;
+    }
+
+    *sep = '\0';
+
+    key = find_key(strip(str));
+    if (!key) {
+      fprintf(stderr, "[config] warning: %s:%u: unknown key \"%s\"\n", path, line, strip(str));
+      continue;
+    }
+
+    set_key(c, key, strip(sep + 1), path);
+  }
+}
+
+static void apply_file(struct video_config *c, const char *profile) {
+  const char *path;
+  FILE *f;
+
+  path = getenv("MALI_HOOK_CONFIG");
+  if (!path)
+    path = default_config_file;
+
+  f = fopen(path, "r");
+  if (!f) {
+    /* Only complain if the file was requested explicitly. */
+    if (path != default_config_file)
+      fprintf(stderr, "[config] warning: failed to open config file %s\n", path);
+
+    return;
+  }
+
+  apply_file_section(c, f, path, NULL);
+
+  if (profile)
+    apply_file_section(c, f, path, profile);
+
+  fclose(f);
+}
+
+static void apply_env(struct video_config *c) {
+  char name[64];
+  unsigned i, j;
+
+  for (i = 0; i < num_config_keys; ++i) {
+    const char *value;
+
+    snprintf(name, sizeof(name), "%s%s", env_prefix, config_keys[i].name);
+
+    for (j = 0; name[j] != '\0'; ++j)
+      name[j] = toupper((unsigned char)name[j]);
+
+    value = getenv(name);
+    if (value)
+      set_key(c, &config_keys[i], value, name);
+  }
+}
+
+void config_apply_overrides(struct video_config *c) {
+  const char *profile;
+
+  profile = getenv("MALI_HOOK_PROFILE");
+  if (!profile)
+    profile = program_invocation_short_name;
+
+  apply_file(c, profile);
+  apply_env(c);
+}
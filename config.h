@@ -0,0 +1,32 @@
+/* This file is part of mali-fbdev-ioctl.
+ * Copyright (C) 2014-2015 - Tobias Jakobi
+ *
+ * mali-fbdev-ioctl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * mali-fbdev-ioctl is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mali-fbdev-ioctl. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+#include "common.h"
+
+/* Apply the runtime overrides to a video config.
+ *
+ * The overrides are read (in increasing order of precedence) from the
+ * global section of the config file, from the section of the config
+ * file matching the profile, and from MALI_HOOK_* environment variables.
+ * The config file is MALI_HOOK_CONFIG or /etc/mali-hook.conf, the profile
+ * is MALI_HOOK_PROFILE or the name of the executable. */
+void config_apply_overrides(struct video_config *c);
+
+#endif /* _CONFIG_H_ */
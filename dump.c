@@ -17,6 +17,9 @@
 
 #include "common.h"
 
+#define PROBE_PROVIDER mali_dump
+#include "probes.h"
+
 #if MALI_VERSION == 0x0400
   #include "mali_ioctl_r4p0.h"
 #elif MALI_VERSION == 0x0500
@@ -343,9 +346,11 @@ int open(const char *pathname, int flags, mode_t mode) {
   if (strcmp(pathname, fbdev_name) == 0) {
     fprintf(stderr, "open called (fbdev) = %d\n", fd);
     fbdev_fd = fd;
+    PROBE1(fbdev_open, fd);
   } else if (strcmp(pathname, mali_name) == 0) {
     fprintf(stderr, "open called (mali) = %d\n", fd);
     mali_fd = fd;
+    PROBE1(mali_open, fd);
   }
 
   return fd;
@@ -363,9 +368,11 @@ int close(int fd) {
   if (fd == fbdev_fd) {
     fprintf(stderr, "close called on fbdev fd = %d\n", ret);
     fbdev_fd = -1;
+    PROBE1(fbdev_close, fd);
   } else if (fd == mali_fd) {
     fprintf(stderr, "close called on mali fd = %d\n", ret);
     mali_fd = -1;
+    PROBE1(mali_close, fd);
   }
 
   return ret;
@@ -385,6 +392,8 @@ int ioctl(int fd, unsigned long request, ...) {
   va_end(args);
 
   if (fd == fbdev_fd) {
+    PROBE2(fbdev_ioctl_begin, fd, request);
+
     switch (request) {
       case FBIOGET_VSCREENINFO:
         fprintf(stderr, "FBIOGET_VSCREENINFO called\n");
@@ -433,7 +442,11 @@ int ioctl(int fd, unsigned long request, ...) {
         ret = fptr(fd, request, p);
         break;
     }
+
+    PROBE3(fbdev_ioctl_end, fd, request, ret);
   } else if (fd == mali_fd) {
+    PROBE2(mali_ioctl_begin, fd, request);
+
     switch (request) {
       case MALI_IOC_GET_API_VERSION:
         fprintf(stderr, "MALI_IOC_GET_API_VERSION called\n");
@@ -476,6 +489,8 @@ int ioctl(int fd, unsigned long request, ...) {
         ret = fptr(fd, request, p);
         break;
     }
+
+    PROBE3(mali_ioctl_end, fd, request, ret);
   } else {
     /* pass-through */
     ret = fptr(fd, request, p);
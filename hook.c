@@ -16,9 +16,14 @@
  */
 
 #include "common.h"
+#include "log.h"
+#include "probes.h"
 
 #include <stdlib.h>
+#include <stdbool.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #if MALI_VERSION == 0x0400
   #include "mali_ioctl_r4p0.h"
@@ -41,6 +46,8 @@ static struct hook_data hook = {
 
   .width = 0,
   .height = 0,
+  .virt_width = 0,
+  .virt_height = 0,
   .pitch = 0,
   .bpp = 0,
   .size = 0,
@@ -58,30 +65,452 @@ static struct hook_data hook = {
   .pages = NULL,
   .num_pages = 0,
   .cur_page = NULL,
-  .pageflip_pending = 0
+  .pageflip_pending = 0,
+
+  .flip_sequence = 0,
+  .flip_time = 0,
+
+  .swap_interval = -1,
+
+  .max_frames = 0,
+
+  .refresh_period = 0,
+
+  .late_latch = 0,
+  .latch_margin = 0,
+
+  .idle_skip = 0,
+
+  .stats = { 0 }
+};
+
+enum {
+  max_fb_mappings = 8,
+  max_timed_frames = 8,
+  max_tracked_jobs = 32,
+
+  /* Upper bound for blocking a job submission, in case the blob only *
+   * pans the previous frame after submitting the next one.           */
+  throttle_timeout_ms = 100
+};
+
+/* Index of the writeback registers (see MALI200_REG_ADDR_WB_*). */
+enum {
+  wb_source_select = 0,
+  wb_target_addr = 1
+};
+
+/* Mali mapping of a framebuffer page. */
+struct fb_mapping {
+  bool used;
+  uint32_t mali_address;
+  uint32_t size;
+  uint64_t cookie;
+};
+
+/* PP job that renders into a framebuffer page. */
+struct frame_job {
+  bool used;
+  uint64_t user_job_ptr;
+  unsigned frame;
+};
+
+/* Start (first PP job submitted) and end (last PP job finished) *
+ * of rendering a frame, in ns.                                  */
+struct frame_timing {
+  uint64_t start;
+  uint64_t finish;
+};
+
+/* Frames queued ahead of the display. A frame is started by the first *
+ * PP job that writes back to a framebuffer page, and finished by the  *
+ * next PAN_DISPLAY.                                                    */
+struct frame_tracker {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  struct fb_mapping mappings[max_fb_mappings];
+
+  unsigned frames_started;
+  unsigned frames_panned;
+
+  int last_mapping; /* mapping written by the previous frame */
+  unsigned last_panned; /* value of frames_panned at the previous frame */
+
+  /* Submission of the first PP job (e.g. an offscreen pass) *
+   * since the last frame started, 0 if there was none.      */
+  uint64_t batch_start;
+
+  struct frame_job jobs[max_tracked_jobs];
+  unsigned next_job;
+
+  struct frame_timing timing[max_timed_frames];
+
+  /* Render time estimate in ns: decaying peak. */
+  uint64_t render_peak;
+
+  /* Idle-frame skip: pages written since they were last shown, the page *
+   * on screen and the page whose skipped pan is still to be shown.       */
+  bool dirty[max_fb_mappings];
+  bool shown[max_fb_mappings];
+  int displayed;
+  int deferred;
+  unsigned pan_x;
+  unsigned pan_y;
 };
 
+static struct frame_tracker frames = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+
+  .frames_started = 0,
+  .frames_panned = 0,
+
+  .last_mapping = -1,
+  .last_panned = 0,
+
+  .batch_start = 0,
+  .next_job = 0,
+
+  .render_peak = 0,
+
+  .displayed = -1,
+  .deferred = -1,
+  .pan_x = 0,
+  .pan_y = 0
+};
+
+/* Class of an fd, as far as the hook is concerned. */
+enum e_fd_class {
+  fd_other = 0,
+  fd_fbdev,
+  fd_mali
+};
+
+enum {
+  max_classified_fds = 1024
+};
+
+/* Class of each fd, so that the wrappers don't need to compare against *
+ * the hook state. Entries are only written when a hooked device is     *
+ * opened or closed (under fd_mutex) and published with release stores, *
+ * the fast path is a single acquire load.                              */
+static uint8_t fd_classes[max_classified_fds];
+static pthread_mutex_t fd_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool symbols_bound = false;
+
+static void bind_symbols() {
+  hook.open = (openfnc)dlsym(RTLD_NEXT, "open");
+  hook.close = (closefnc)dlsym(RTLD_NEXT, "close");
+  hook.ioctl = (ioctlfnc)dlsym(RTLD_NEXT, "ioctl");
+  hook.mmap = (mmapfnc)dlsym(RTLD_NEXT, "mmap");
+  hook.munmap = (munmapfnc)dlsym(RTLD_NEXT, "munmap");
+
+  __atomic_store_n(&symbols_bound, true, __ATOMIC_RELEASE);
+}
+
+/* The symbols are bound when the library is loaded. Calls from other *
+ * constructors that run before ours bind them on demand.             */
+static void __attribute__((constructor)) hook_constructor() {
+  bind_symbols();
+}
+
+static inline void ensure_symbols() {
+  if (__builtin_expect(!__atomic_load_n(&symbols_bound, __ATOMIC_ACQUIRE), 0))
+    bind_symbols();
+}
+
+static inline unsigned get_fd_class(int fd) {
+  if (__builtin_expect((unsigned)fd < max_classified_fds, 1))
+    return __atomic_load_n(&fd_classes[fd], __ATOMIC_ACQUIRE);
+
+  /* Hooked fds beyond the table are compared directly. */
+  if (fd < 0)
+    return fd_other;
+
+  if (fd == __atomic_load_n(&hook.fbdev_fd, __ATOMIC_ACQUIRE))
+    return fd_fbdev;
+
+  if (fd == __atomic_load_n(&hook.mali_fd, __ATOMIC_ACQUIRE))
+    return fd_mali;
+
+  return fd_other;
+}
+
+static void set_fd_class(int fd, unsigned fd_class) {
+  if ((unsigned)fd < max_classified_fds)
+    __atomic_store_n(&fd_classes[fd], fd_class, __ATOMIC_RELEASE);
+}
+
+static uint64_t get_time_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* EGLBoolean (*)(EGLDisplay, EGLint) */
+typedef unsigned (*eglswapintervalfnc)(void*, int);
+
+static eglswapintervalfnc egl_swap_interval = NULL;
+
 static hsetupfnc hinit = NULL;
 static hsetupfnc hfree = NULL;
 static hflipfnc hflip = NULL;
 static hbufferfnc hbuffer = NULL;
 
-void setup_hook_callback(hsetupfnc init_, hsetupfnc free_,
+struct hook_data *setup_hook_callback(hsetupfnc init_, hsetupfnc free_,
   hflipfnc flip_, hbufferfnc buffer_) {
-#ifdef HOOK_VERBOSE
-  fprintf(stderr, "info: setup_hook_callback called\n");
-#endif
+  log_debug("called");
 
   hinit = init_;
   hfree = free_;
   hflip = flip_;
   hbuffer = buffer_;
+
+  /* The display bring-up might open the DRM device before the *
+   * application opens anything through us.                    */
+  ensure_symbols();
+
+  return &hook;
 }
 
 int hook_get_drm_fd() {
+  /* Imports on the fd may now alias handles of the application. */
+  __atomic_store_n(&hook.drm_fd_shared, 1, __ATOMIC_RELEASE);
+
   return hook.drm_fd;
 }
 
+/* Track the swap interval of the application, the flip path paces *
+ * the page flips accordingly.                                      */
+unsigned eglSwapInterval(void *dpy, int interval) {
+  if (egl_swap_interval == NULL)
+    egl_swap_interval = (eglswapintervalfnc)dlsym(RTLD_NEXT, "eglSwapInterval");
+
+  __atomic_store_n(&hook.swap_interval, interval < 0 ? 0 : interval, __ATOMIC_RELAXED);
+
+  if (egl_swap_interval == NULL)
+    return 0;
+
+  return egl_swap_interval(dpy, interval);
+}
+
+#ifdef SWAP_PROFILER
+
+/* Swap-to-scanout latency profiler (build with swap_profiler=1).       *
+ * eglSwapBuffers() is timed and matched (in order) with the next       *
+ * PAN_DISPLAY, each pan with the flip completion that follows it.      *
+ * The histograms are reported when the fbdev is closed and on exit.   */
+enum {
+  profile_buckets = 21, /* bucket i: [2^i, 2^(i+1)) us, up to ~2 s */
+  max_pending_swaps = 4
+};
+
+struct latency_histogram {
+  const char *name;
+
+  unsigned count;
+  uint64_t sum;
+  uint64_t max;
+  unsigned buckets[profile_buckets];
+};
+
+struct swap_profiler {
+  pthread_mutex_t mutex;
+
+  /* Entry times of the swaps that haven't been panned yet. */
+  uint64_t swaps[max_pending_swaps];
+  unsigned swap_first;
+  unsigned swap_count;
+
+  /* Start of the last pan whose flip hasn't completed yet, 0 if none. */
+  uint64_t pending_pan;
+  uint64_t last_flip_time;
+
+  struct latency_histogram swap_time;
+  struct latency_histogram swap_to_pan;
+  struct latency_histogram pan_to_scanout;
+};
+
+static struct swap_profiler profiler = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+
+  .swap_time = { .name = "inside eglSwapBuffers" },
+  .swap_to_pan = { .name = "eglSwapBuffers to PAN_DISPLAY" },
+  .pan_to_scanout = { .name = "PAN_DISPLAY to scanout" }
+};
+
+/* EGLBoolean (*)(EGLDisplay, EGLSurface) */
+typedef unsigned (*eglswapbuffersfnc)(void*, void*);
+
+static eglswapbuffersfnc egl_swap_buffers = NULL;
+
+static void histogram_add(struct latency_histogram *h, uint64_t ns) {
+  uint64_t us = ns / 1000;
+  unsigned bucket = 0;
+
+  while (us > 1 && bucket < profile_buckets - 1) {
+    us >>= 1;
+    ++bucket;
+  }
+
+  h->buckets[bucket]++;
+  h->count++;
+  h->sum += ns;
+
+  if (ns > h->max)
+    h->max = ns;
+}
+
+static void histogram_print(struct latency_histogram *h) {
+  unsigned i, peak = 0;
+
+  if (h->count == 0)
+    return;
+
+  fprintf(stderr, "[swap_profiler] %s: %u frames, avg %.3f ms, max %.3f ms\n",
+          h->name, h->count, (double)h->sum / h->count / 1000000.0, (double)h->max / 1000000.0);
+
+  for (i = 0; i < profile_buckets; ++i) {
+    if (h->buckets[i] > peak)
+      peak = h->buckets[i];
+  }
+
+  for (i = 0; i < profile_buckets; ++i) {
+    char bar[41];
+    unsigned len;
+
+    if (h->buckets[i] == 0)
+      continue;
+
+    len = (h->buckets[i] * 40 + peak - 1) / peak;
+    memset(bar, '#', len);
+    bar[len] = '\0';
+
+    fprintf(stderr, "  %9.3f - %9.3f ms %7u %s\n", (i == 0) ? 0.0 : (double)(1u << i) / 1000.0,
+            (double)(2u << i) / 1000.0, h->buckets[i], bar);
+  }
+
+  memset(h->buckets, 0, sizeof(h->buckets));
+  h->count = 0;
+  h->sum = 0;
+  h->max = 0;
+}
+
+static void profile_report() {
+  pthread_mutex_lock(&profiler.mutex);
+
+  histogram_print(&profiler.swap_time);
+  histogram_print(&profiler.swap_to_pan);
+  histogram_print(&profiler.pan_to_scanout);
+
+  pthread_mutex_unlock(&profiler.mutex);
+}
+
+static void __attribute__((destructor)) profile_destructor() {
+  profile_report();
+}
+
+/* Attribute a completed flip to the pending pan. *
+ * Called with profiler.mutex held.                */
+static void profile_match_flip() {
+  const uint64_t flip_time = __atomic_load_n(&hook.flip_time, __ATOMIC_RELAXED);
+
+  if (profiler.pending_pan == 0 || flip_time == profiler.last_flip_time ||
+      flip_time < profiler.pending_pan)
+    return;
+
+  histogram_add(&profiler.pan_to_scanout, flip_time - profiler.pending_pan);
+  PROBE2(pan_to_scanout, profiler.pending_pan, flip_time);
+
+  profiler.last_flip_time = flip_time;
+  profiler.pending_pan = 0;
+}
+
+static uint64_t profile_pan_begin() {
+  const uint64_t now = get_time_ns();
+
+  pthread_mutex_lock(&profiler.mutex);
+
+  profile_match_flip();
+
+  if (profiler.swap_count != 0) {
+    const uint64_t swap = profiler.swaps[profiler.swap_first];
+
+    profiler.swap_first = (profiler.swap_first + 1) % max_pending_swaps;
+    profiler.swap_count--;
+
+    histogram_add(&profiler.swap_to_pan, now - swap);
+    PROBE2(swap_to_pan, swap, now);
+  }
+
+  pthread_mutex_unlock(&profiler.mutex);
+
+  return now;
+}
+
+/* A pan that didn't flip (skipped or failed) has no scanout. */
+static void profile_pan_end(uint64_t start, bool flipped) {
+  pthread_mutex_lock(&profiler.mutex);
+
+  if (flipped) {
+    /* A previous flip that never completed is superseded. */
+    profiler.pending_pan = start;
+    profile_match_flip();
+  }
+
+  pthread_mutex_unlock(&profiler.mutex);
+}
+
+unsigned eglSwapBuffers(void *dpy, void *surface) {
+  uint64_t enter, leave;
+  unsigned ret;
+
+  if (egl_swap_buffers == NULL)
+    egl_swap_buffers = (eglswapbuffersfnc)dlsym(RTLD_NEXT, "eglSwapBuffers");
+
+  if (egl_swap_buffers == NULL)
+    return 0;
+
+  enter = get_time_ns();
+  ret = egl_swap_buffers(dpy, surface);
+  leave = get_time_ns();
+
+  pthread_mutex_lock(&profiler.mutex);
+
+  histogram_add(&profiler.swap_time, leave - enter);
+
+  /* The oldest swap is dropped, if the blob doesn't pan at all. */
+  if (profiler.swap_count == max_pending_swaps) {
+    profiler.swap_first = (profiler.swap_first + 1) % max_pending_swaps;
+    profiler.swap_count--;
+  }
+
+  profiler.swaps[(profiler.swap_first + profiler.swap_count) % max_pending_swaps] = enter;
+  profiler.swap_count++;
+
+  pthread_mutex_unlock(&profiler.mutex);
+
+  return ret;
+}
+
+#else
+
+static inline uint64_t profile_pan_begin() {
+  return 0;
+}
+
+static inline void profile_pan_end(uint64_t start, bool flipped) {
+}
+
+static inline void profile_report() {
+}
+
+#endif
+
 static const char* translate_mali_ioctl(unsigned long request) {
   switch (request) {
    case MALI_IOC_WAIT_FOR_NOTIFICATION:
@@ -156,9 +585,7 @@ static const char* translate_mali_ioctl(unsigned long request) {
 }
 
 static int emulate_get_var_screeninfo(void *ptr) {
-#ifdef HOOK_VERBOSE
-  fprintf(stderr, "info: emulate_get_var_screeninfo called\n");
-#endif
+  log_debug("called");
 
   if (hook.fake_vscreeninfo) {
     memcpy(ptr, hook.fake_vscreeninfo, sizeof(struct fb_var_screeninfo));
@@ -169,18 +596,14 @@ static int emulate_get_var_screeninfo(void *ptr) {
 }
 
 static int emulate_put_var_screeninfo(void *ptr) {
-#ifndef QUIET_NONIMPLEMENTED
-  fprintf(stderr, "info: emulate_put_var_screeninfo called\n");
-#endif
+  log_info("not implemented");
 
   /* TODO: implement */
   return -ENOTTY;
 }
 
 static int emulate_get_fix_screeninfo(void *ptr) {
-#ifdef HOOK_VERBOSE
-  fprintf(stderr, "info: emulate_get_fix_screeninfo called\n");
-#endif
+  log_debug("called");
 
   if (hook.fake_fscreeninfo) {
     memcpy(ptr, hook.fake_fscreeninfo, sizeof(struct fb_fix_screeninfo));
@@ -190,53 +613,188 @@ static int emulate_get_fix_screeninfo(void *ptr) {
   }
 }
 
+/* Feed the render time of a frame into the estimate. *
+ * Called with frames.mutex held.                     */
+static void update_render_time(const struct frame_timing *t) {
+  uint64_t sample;
+
+  if (t->finish <= t->start)
+    return;
+
+  sample = t->finish - t->start;
+
+  frames.render_peak -= frames.render_peak / 16;
+  if (sample > frames.render_peak)
+    frames.render_peak = sample;
+}
+
+/* A PAN_DISPLAY hands the oldest queued frame to the display. */
+static void track_pan() {
+  pthread_mutex_lock(&frames.mutex);
+
+  /* Pans without a recognized frame (e.g. the initial one) don't count. */
+  if (frames.frames_panned != frames.frames_started) {
+    update_render_time(&frames.timing[frames.frames_panned % max_timed_frames]);
+
+    frames.frames_panned++;
+    pthread_cond_broadcast(&frames.cond);
+  }
+
+  pthread_mutex_unlock(&frames.mutex);
+}
+
+/* A pan to a page that wasn't rendered to since it was last shown doesn't *
+ * change the content of the screen, so the flip is skipped. The page that  *
+ * stays on screen is flipped away once the blob starts rendering into it.  */
+static bool idle_skip(unsigned page, unsigned xoffset, unsigned yoffset) {
+  bool skip = false;
+
+  if (!hook.idle_skip || page >= max_fb_mappings)
+    return false;
+
+  pthread_mutex_lock(&frames.mutex);
+
+  if (frames.displayed >= 0 && frames.shown[page] && !frames.dirty[page] &&
+      xoffset == frames.pan_x && yoffset == frames.pan_y) {
+    frames.deferred = (page != frames.displayed) ? (int)page : -1;
+    skip = true;
+  }
+
+  pthread_mutex_unlock(&frames.mutex);
+
+  if (skip)
+    __atomic_add_fetch(&hook.stats.skipped_frames, 1, __ATOMIC_RELAXED);
+
+  return skip;
+}
+
+static void track_shown(unsigned page, unsigned xoffset, unsigned yoffset) {
+  if (page >= max_fb_mappings)
+    return;
+
+  pthread_mutex_lock(&frames.mutex);
+
+  frames.displayed = page;
+  frames.deferred = -1;
+  frames.shown[page] = true;
+  frames.dirty[page] = false;
+  frames.pan_x = xoffset;
+  frames.pan_y = yoffset;
+
+  pthread_mutex_unlock(&frames.mutex);
+}
+
+/* Hold the renderer back, so that the next frame finishes rendering *
+ * (according to the peak render time) just before its vblank. The   *
+ * application then samples its input as late as possible.           */
+static void late_latch() {
+  const uint64_t period = hook.refresh_period;
+  const uint64_t last_flip = __atomic_load_n(&hook.flip_time, __ATOMIC_RELAXED);
+  uint64_t render, now, vblank, wake;
+  struct timespec ts;
+
+  if (!hook.late_latch || period == 0 || last_flip == 0)
+    return;
+
+  pthread_mutex_lock(&frames.mutex);
+  render = frames.render_peak;
+  pthread_mutex_unlock(&frames.mutex);
+
+  if (render == 0)
+    return;
+
+  now = get_time_ns();
+
+  /* The next vblank, and the one after if it is taken by a queued flip. */
+  vblank = last_flip + ((now - last_flip) / period + 1) * period;
+  if (__atomic_load_n(&hook.pageflip_pending, __ATOMIC_RELAXED) != 0)
+    vblank += period;
+
+  if (vblank < now + render + hook.latch_margin)
+    return;
+
+  wake = vblank - render - hook.latch_margin;
+
+  ts.tv_sec = wake / 1000000000ull;
+  ts.tv_nsec = wake % 1000000000ull;
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
 static int emulate_pan_display(void *ptr) {
   const struct fb_var_screeninfo *data = ptr;
-  int ret = -ENOTTY;
+  unsigned page, yoffset;
+  uint64_t start;
+  int ret;
+
+  if (hook.virt_height == 0)
+    return -ENOTTY;
+
+  /* The visible area has to stay within a single page. */
+  page = data->yoffset / hook.virt_height;
+  yoffset = data->yoffset % hook.virt_height;
+
+  if (data->xoffset + hook.width > hook.virt_width ||
+      yoffset + hook.height > hook.virt_height)
+    return -EINVAL;
 
-  if (data->xoffset == 0 && ((data->yoffset % hook.height) == 0))
-    ret = hflip(&hook, data->yoffset / hook.height);
+  PROBE3(pan_begin, page, data->xoffset, yoffset);
+
+  start = profile_pan_begin();
+
+  if (idle_skip(page, data->xoffset, yoffset)) {
+    track_pan();
+    profile_pan_end(start, false);
+    PROBE1(pan_skip, page);
+    return 0;
+  }
+
+  ret = hflip(&hook, page, data->xoffset, yoffset);
+  profile_pan_end(start, ret == 0);
+
+  if (ret == 0) {
+    track_shown(page, data->xoffset, yoffset);
+    track_pan();
+    late_latch();
+  }
+
+  PROBE2(pan_end, page, ret);
 
   return ret;
 }
 
 static int emulate_waitforvsync(void *ptr) {
-#ifndef QUIET_NONIMPLEMENTED
-  fprintf(stderr, "info: emulate_waitforvsync called\n");
-#endif
+  log_info("not implemented");
 
   /* TODO: implement */
   return -ENOTTY;
 }
 
 static int emulate_get_fb_dma_buf(void *ptr) {
-#ifndef QUIET_NONIMPLEMENTED
-  fprintf(stderr, "info: emulate_get_fb_dma_buf called\n");
-#endif
+  log_info("not implemented");
 
   /* TODO: implement */
   return -ENOTTY;
 }
 
 static int emulate_mali_mem_map_ext(void *ptr) {
-#ifdef HOOK_VERBOSE
-  fprintf(stderr, "info: emulate_mali_mem_map_ext called\n");
-#endif
+  log_debug("called");
 
   _mali_uk_map_external_mem_s *data = ptr;
+  unsigned bufidx = 0;
   int buf_fd = -1;
 
   if (hook.base_addr <= data->phys_addr) {
     const unsigned long offset = data->phys_addr - hook.base_addr;
 
-    if ((offset % hook.size) == 0)
-      buf_fd = hbuffer(&hook, offset / hook.size);
+    if ((offset % hook.size) == 0) {
+      bufidx = offset / hook.size;
+      buf_fd = hbuffer(&hook, bufidx);
+    }
   }
 
   if (buf_fd != -1) {
-#ifdef HOOK_VERBOSE
-    fprintf(stderr, "info: translating to dma-buf attach\n");
-#endif
+    log_debug("translating to dma-buf attach");
 
     _mali_uk_attach_dma_buf_s newdata = { 0 };
     int ret;
@@ -251,6 +809,17 @@ static int emulate_mali_mem_map_ext(void *ptr) {
     ret = hook.ioctl(hook.mali_fd, MALI_IOC_MEM_ATTACH_DMA_BUF, &newdata);
 
     data->cookie = newdata.cookie;
+
+    PROBE4(mem_attach, bufidx, data->mali_address, data->size, ret);
+
+    if (ret == 0 && bufidx < max_fb_mappings) {
+      pthread_mutex_lock(&frames.mutex);
+      frames.mappings[bufidx] = (struct fb_mapping){
+        true, data->mali_address, data->size, data->cookie
+      };
+      pthread_mutex_unlock(&frames.mutex);
+    }
+
     return ret;
   } else {
     return -ENOTTY;
@@ -258,78 +827,301 @@ static int emulate_mali_mem_map_ext(void *ptr) {
 }
 
 static int emulate_mali_mem_unmap_ext(void *ptr) {
-#ifdef HOOK_VERBOSE
-  fprintf(stderr, "info: emulate_mali_mem_unmap_ext called\n");
-  fprintf(stderr, "info: translating to dma-buf release\n");
-#endif
+  log_debug("translating to dma-buf release");
+
+  const _mali_uk_unmap_external_mem_s *data = ptr;
+  unsigned i;
+
+  pthread_mutex_lock(&frames.mutex);
+
+  for (i = 0; i < max_fb_mappings; ++i) {
+    if (frames.mappings[i].used && frames.mappings[i].cookie == data->cookie)
+      frames.mappings[i].used = false;
+  }
+
+  pthread_mutex_unlock(&frames.mutex);
+
+  PROBE1(mem_release, data->cookie);
 
   /* data structures are compatible */
   return hook.ioctl(hook.mali_fd, MALI_IOC_MEM_RELEASE_DMA_BUF, ptr);
 }
 
-int open(const char *pathname, int flags, mode_t mode) {
-  int fd;
+/* Find the framebuffer page a PP job writes back to. *
+ * Called with frames.mutex held.                     */
+static int get_job_mapping(const _mali_uk_pp_start_job_s *job) {
+  const uint32_t address = job->wb0_registers[wb_target_addr];
+  unsigned i;
 
-  if (hook.open == NULL)
-    hook.open = (openfnc)dlsym(RTLD_NEXT, "open");
+  if (job->wb0_registers[wb_source_select] == 0)
+    return -1;
 
-  if (strcmp(pathname, fbdev_name) == 0) {
-    fprintf(stderr, "open called (fbdev)\n");
-    hook.fbdev_fd = hook.open(fake_fbdev, O_RDWR, 0);
-#ifdef HOOK_VERBOSE
-    fprintf(stderr, "fake fbdev fd = %d\n", hook.fbdev_fd);
-#endif
+  for (i = 0; i < max_fb_mappings; ++i) {
+    const struct fb_mapping *m = &frames.mappings[i];
 
-    if (hinit && hinit(&hook)) {
-      fprintf(stderr, "error: hook initialization failed\n");
-      hook.close(hook.fbdev_fd);
-      hook.fbdev_fd = -1;
-      return -1;
+    if (m->used && address >= m->mali_address && address - m->mali_address < m->size)
+      return i;
+  }
+
+  return -1;
+}
+
+/* Account for a PP job that is about to be submitted. If it starts  *
+ * a new frame and too many frames are queued ahead of the display,  *
+ * the caller is blocked until the display catches up.               *
+ * Returns true if the job started a new frame.                      */
+static bool track_job_begin(const _mali_uk_pp_start_job_s *job) {
+  const unsigned max_frames = hook.max_frames;
+  bool started = false;
+  int mapping;
+
+  pthread_mutex_lock(&frames.mutex);
+
+  mapping = get_job_mapping(job);
+
+  if (mapping < 0) {
+    if (frames.batch_start == 0)
+      frames.batch_start = get_time_ns();
+
+    goto out;
+  }
+
+  frames.dirty[mapping] = true;
+
+  /* Further jobs for the same page belong to the same frame. */
+  if (mapping == frames.last_mapping && frames.frames_panned == frames.last_panned)
+    goto record;
+
+  if (max_frames != 0) {
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += throttle_timeout_ms * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+
+    while (frames.frames_started - frames.frames_panned >= max_frames) {
+      if (pthread_cond_timedwait(&frames.cond, &frames.mutex, &deadline) == ETIMEDOUT)
+        break;
     }
+  }
 
-    fd = hook.fbdev_fd;
-  } else if (strcmp(pathname, mali_name) == 0) {
-    fprintf(stderr, "open called (mali)\n");
-    hook.mali_fd = hook.open(pathname, flags, mode);
-#ifdef HOOK_VERBOSE
-    fprintf(stderr, "mali fd = %d\n", hook.mali_fd);
-#endif
-    fd = hook.mali_fd;
-  } else {
-    fd = hook.open(pathname, flags, mode);
+  frames.timing[frames.frames_started % max_timed_frames] = (struct frame_timing){
+    frames.batch_start != 0 ? frames.batch_start : get_time_ns(), 0
+  };
+  frames.batch_start = 0;
+
+  frames.frames_started++;
+  frames.last_mapping = mapping;
+  frames.last_panned = frames.frames_panned;
+  started = true;
+
+record:
+  /* Remember the job, its completion ends the rendering of the frame. */
+  frames.jobs[frames.next_job] = (struct frame_job){
+    true, job->user_job_ptr, frames.frames_started - 1
+  };
+  frames.next_job = (frames.next_job + 1) % max_tracked_jobs;
+
+out:
+  pthread_mutex_unlock(&frames.mutex);
+
+  return started;
+}
+
+/* The blob is about to render into the page that is still on screen *
+ * because a pan was skipped. Show the page of that pan first.        */
+static void flush_deferred(const _mali_uk_pp_start_job_s *job) {
+  int page = -1;
+  unsigned xoffset = 0, yoffset = 0;
+
+  pthread_mutex_lock(&frames.mutex);
+
+  if (frames.deferred >= 0 && get_job_mapping(job) == frames.displayed) {
+    page = frames.deferred;
+    xoffset = frames.pan_x;
+    yoffset = frames.pan_y;
+    frames.deferred = -1;
+  }
+
+  pthread_mutex_unlock(&frames.mutex);
+
+  if (page >= 0 && hflip(&hook, page, xoffset, yoffset) == 0)
+    track_shown(page, xoffset, yoffset);
+}
+
+static int emulate_mali_pp_start_job(int fd, unsigned long request, void *ptr,
+                                     const _mali_uk_pp_start_job_s *job) {
+  bool started;
+  int ret;
+
+  flush_deferred(job);
+  started = track_job_begin(job);
+
+  ret = hook.ioctl(fd, request, ptr);
+
+  pthread_mutex_lock(&frames.mutex);
+
+  if (ret == 0)
+    __atomic_add_fetch(&hook.stats.pp_jobs_in_flight, 1, __ATOMIC_RELAXED);
+  else if (started)
+    frames.frames_started--;
+
+  pthread_mutex_unlock(&frames.mutex);
+
+  return ret;
+}
+
+static int emulate_mali_wait_for_notification(int fd, void *ptr) {
+  const _mali_uk_wait_for_notification_s *data = ptr;
+  int ret;
+
+  ret = hook.ioctl(fd, MALI_IOC_WAIT_FOR_NOTIFICATION, ptr);
+
+  if (ret == 0 && data->type == _MALI_NOTIFICATION_PP_FINISHED) {
+    const uint64_t user_job_ptr = data->data.pp_job_finished.user_job_ptr;
+    unsigned i;
+
+    pthread_mutex_lock(&frames.mutex);
+
+    /* Jobs submitted before the fd was tracked don't count. */
+    if (hook.stats.pp_jobs_in_flight > 0)
+      __atomic_sub_fetch(&hook.stats.pp_jobs_in_flight, 1, __ATOMIC_RELAXED);
+
+    for (i = 0; i < max_tracked_jobs; ++i) {
+      struct frame_job *j = &frames.jobs[i];
+
+      if (j->used && j->user_job_ptr == user_job_ptr) {
+        frames.timing[j->frame % max_timed_frames].finish = get_time_ns();
+        j->used = false;
+        break;
+      }
+    }
+
+    pthread_mutex_unlock(&frames.mutex);
   }
 
+  return ret;
+}
+
+/* Only paths below /dev can be one of the hooked devices. */
+static inline bool is_dev_path(const char *pathname) {
+  return pathname[0] == '/' && pathname[1] == 'd' && strncmp(pathname, "/dev/", 5) == 0;
+}
+
+static int open_fbdev() {
+  int fd;
+
+  log_info("opening fake fbdev");
+
+  pthread_mutex_lock(&fd_mutex);
+
+  fd = hook.open(fake_fbdev, O_RDWR, 0);
+  log_debug("fake fbdev fd = %d", fd);
+
+  if (fd < 0)
+    goto out;
+
+  if (hinit && hinit(&hook)) {
+    log_error("hook initialization failed");
+    hook.close(fd);
+    fd = -1;
+    goto out;
+  }
+
+  /* Publishes the state set up by hinit as well. */
+  __atomic_store_n(&hook.fbdev_fd, fd, __ATOMIC_RELEASE);
+  set_fd_class(fd, fd_fbdev);
+
+  PROBE1(fbdev_open, fd);
+
+out:
+  pthread_mutex_unlock(&fd_mutex);
   return fd;
 }
 
+static int open_mali(const char *pathname, int flags, mode_t mode) {
+  int fd;
+
+  log_info("opening mali");
+
+  pthread_mutex_lock(&fd_mutex);
+
+  fd = hook.open(pathname, flags, mode);
+  log_debug("mali fd = %d", fd);
+
+  if (fd >= 0) {
+    __atomic_store_n(&hook.mali_fd, fd, __ATOMIC_RELEASE);
+    set_fd_class(fd, fd_mali);
+
+    PROBE1(mali_open, fd);
+  }
+
+  pthread_mutex_unlock(&fd_mutex);
+  return fd;
+}
+
+int open(const char *pathname, int flags, mode_t mode) {
+  ensure_symbols();
+
+  if (__builtin_expect(is_dev_path(pathname), 0)) {
+    if (strcmp(pathname, fbdev_name) == 0)
+      return open_fbdev();
+
+    if (strcmp(pathname, mali_name) == 0)
+      return open_mali(pathname, flags, mode);
+  }
+
+  return hook.open(pathname, flags, mode);
+}
+
 int close(int fd) {
-  if (hook.close == NULL)
-    hook.close = (closefnc)dlsym(RTLD_NEXT, "close");
+  const unsigned fd_class = get_fd_class(fd);
 
-  if (fd == hook.fbdev_fd) {
-    fprintf(stderr, "close called on fake fbdev fd\n");
+  ensure_symbols();
+
+  if (__builtin_expect(fd_class == fd_other, 1))
+    return hook.close(fd);
+
+  pthread_mutex_lock(&fd_mutex);
+
+  /* The fd number may be reused as soon as it is closed, so the *
+   * class is withdrawn first.                                   */
+  if (fd_class == fd_fbdev) {
+    log_info("closing fake fbdev fd");
+
+    profile_report();
 
     if (hfree && hfree(&hook)) {
-      fprintf(stderr, "error: freeing hook failed\n");
+      log_error("freeing hook failed");
+      pthread_mutex_unlock(&fd_mutex);
       return -1;
     }
 
-    hook.fbdev_fd = -1;
-  } else if (fd == hook.mali_fd) {
-    fprintf(stderr, "close called on mali fd\n");
-    hook.mali_fd = -1;
+    set_fd_class(fd, fd_other);
+    __atomic_store_n(&hook.fbdev_fd, -1, __ATOMIC_RELEASE);
+
+    PROBE1(fbdev_close, fd);
+  } else if (fd_class == fd_mali) {
+    log_info("closing mali fd");
+
+    set_fd_class(fd, fd_other);
+    __atomic_store_n(&hook.mali_fd, -1, __ATOMIC_RELEASE);
+
+    PROBE1(mali_close, fd);
   }
 
+  pthread_mutex_unlock(&fd_mutex);
+
   return hook.close(fd);
 }
 
 void *mmap(void *addr, size_t length, int prot,
            int flags, int fd, off_t offset) {
-  if (hook.mmap == NULL)
-    hook.mmap = (mmapfnc)dlsym(RTLD_NEXT, "mmap");
+  ensure_symbols();
 
-  if (hook.fbdev_fd != -1 && fd == hook.fbdev_fd) {
-    fprintf(stderr, "mmap called on fake fbdev fd\n");
+  if (__builtin_expect(get_fd_class(fd) == fd_fbdev, 0)) {
+    log_info("mapping fake fbdev fd");
 
     void *ret = NULL;
 
@@ -348,11 +1140,10 @@ void *mmap(void *addr, size_t length, int prot,
 }
 
 int munmap(void *addr, size_t length) {
-  if (hook.munmap == NULL)
-    hook.munmap = (munmapfnc)dlsym(RTLD_NEXT, "munmap");
+  ensure_symbols();
 
-  if (hook.fake_mmap != NULL && addr == hook.fake_mmap) {
-    fprintf(stderr, "munmap called on fake fbdev fd\n");
+  if (__builtin_expect(hook.fake_mmap != NULL && addr == hook.fake_mmap, 0)) {
+    log_info("unmapping fake fbdev");
 
     free(hook.fake_mmap);
     hook.fake_mmap = NULL;
@@ -365,10 +1156,10 @@ int munmap(void *addr, size_t length) {
 }
 
 int ioctl(int fd, unsigned long request, ...) {
+  const unsigned fd_class = get_fd_class(fd);
   int ret = -1;
 
-  if (hook.ioctl == NULL)
-    hook.ioctl = (ioctlfnc)dlsym(RTLD_NEXT, "ioctl");
+  ensure_symbols();
 
   va_list args;
 
@@ -376,7 +1167,10 @@ int ioctl(int fd, unsigned long request, ...) {
   void *p = va_arg(args, void *);
   va_end(args);
 
-  if (fd == hook.fbdev_fd) {
+  if (__builtin_expect(fd_class == fd_other, 1)) {
+    /* pass-through */
+    ret = hook.ioctl(fd, request, p);
+  } else if (fd_class == fd_fbdev) {
     switch (request) {
       case FBIOGET_VSCREENINFO:
         ret = emulate_get_var_screeninfo(p);
@@ -403,11 +1197,11 @@ int ioctl(int fd, unsigned long request, ...) {
         break;
 
       default:
-        fprintf(stderr, "info: unhooked fbdev ioctl (0x%x) called\n", (unsigned int)request);
+        log_info("unhooked fbdev ioctl (0x%x)", (unsigned int)request);
         ret = hook.ioctl(fd, request, p);
         break;
     }
-  } else if (fd == hook.mali_fd) {
+  } else {
     switch (request) {
       case MALI_IOC_MEM_MAP_EXT:
         ret = emulate_mali_mem_map_ext(p);
@@ -417,16 +1211,31 @@ int ioctl(int fd, unsigned long request, ...) {
         ret = emulate_mali_mem_unmap_ext(p);
         break;
 
-      default:
-#ifdef HOOK_VERBOSE
-        fprintf(stderr, "info: unhooked mali ioctl (%s) called\n", translate_mali_ioctl(request));
+      case MALI_IOC_PP_START_JOB:
+        ret = emulate_mali_pp_start_job(fd, request, p, p);
+        break;
+
+      case MALI_IOC_PP_AND_GP_START_JOB: {
+        const _mali_uk_pp_and_gp_start_job_s *args = p;
+
+#if MALI_VERSION == 0x0400
+        ret = emulate_mali_pp_start_job(fd, request, p, args->pp_args);
+#else
+        ret = emulate_mali_pp_start_job(fd, request, p,
+          (const _mali_uk_pp_start_job_s *)(uintptr_t)args->pp_args);
 #endif
+        break;
+      }
+
+      case MALI_IOC_WAIT_FOR_NOTIFICATION:
+        ret = emulate_mali_wait_for_notification(fd, p);
+        break;
+
+      default:
+        log_debug("unhooked mali ioctl (%s)", translate_mali_ioctl(request));
         ret = hook.ioctl(fd, request, p);
         break;
     }
-  } else {
-    /* pass-through */
-    ret = hook.ioctl(fd, request, p);
   }
 
   return ret;
@@ -0,0 +1,757 @@
+/* This file is part of mali-fbdev-ioctl.
+ * Copyright (C) 2014-2015 - Tobias Jakobi
+ *
+ * mali-fbdev-ioctl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * mali-fbdev-ioctl is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mali-fbdev-ioctl. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/eventfd.h>
+
+enum {
+  log_ring_size = 256, /* power of two */
+  log_line_size = 256,
+
+  /* Arguments and bytes of %s arguments a message can carry. */
+  log_max_args = 8,
+  log_string_size = 128,
+
+  /* Messages per call site and second. */
+  log_burst = 10,
+
+  /* Upper bound for draining the ring on exit, in ms. */
+  log_flush_timeout_ms = 1000
+};
+
+/* Length modifiers of a conversion specification. */
+enum e_log_length {
+  length_none = 0,
+  length_hh,
+  length_h,
+  length_l,
+  length_ll,
+  length_z,
+  length_j,
+  length_t,
+  length_L
+};
+
+/* A conversion specification, from the '%' up to the conversion. */
+struct log_spec {
+  const char *start;
+  const char *modifier; /* start of the length modifier */
+  const char *end;
+  char conv;
+  unsigned length;
+  bool star_width;
+  bool star_precision;
+};
+
+/* An argument of a message, widened to 64 bits. Strings are *
+ * copied into the message, u holds their offset then.       */
+union log_arg {
+  int64_t i;
+  uint64_t u;
+  double d;
+  const void *p;
+};
+
+/* A message as the caller queues it. The writer thread formats it, *
+ * so fmt and func have to stay valid (literals and __func__ do).   */
+struct log_message {
+  uint64_t time;
+  const char *func;
+  const char *fmt;
+  int level;
+  unsigned suppressed;
+
+  unsigned num_args;
+  bool truncated; /* more arguments than fit */
+  union log_arg args[log_max_args];
+
+  unsigned string_size;
+  char strings[log_string_size];
+};
+
+/* An entry of the ring. turn is 2 * lap while the entry is free *
+ * and 2 * lap + 1 while it holds a message of that lap.         */
+struct log_entry {
+  uint64_t turn;
+  struct log_message msg;
+};
+
+static const char *level_names[] = {
+  "error", "warning", "info", "debug"
+};
+
+/* Offsets of %s arguments that weren't copied. */
+static const uint64_t null_string = ~0ull;
+static const uint64_t cut_string = ~1ull;
+
+#ifdef HOOK_VERBOSE
+int log_max_level = log_level_debug;
+#else
+int log_max_level = log_level_info;
+#endif
+
+/* Multiple producers (any thread that logs), one consumer (the writer). */
+static struct log_entry ring[log_ring_size];
+static uint64_t ring_head = 0;
+static uint64_t ring_tail = 0;
+
+static unsigned dropped = 0;
+
+static pthread_once_t writer_once = PTHREAD_ONCE_INIT;
+static bool writer_running = false;
+static unsigned writer_waiting = 0;
+static int wake_fd = -1;
+
+static uint64_t get_time_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void write_all(const char *text, unsigned length) {
+  while (length > 0) {
+    const ssize_t ret = write(STDERR_FILENO, text, length);
+
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+
+      return;
+    }
+
+    text += ret;
+    length -= ret;
+  }
+}
+
+/* Parse the conversion specification starting at the '%' in p. */
+static void parse_spec(const char *p, struct log_spec *spec) {
+  spec->start = p++;
+  spec->star_width = false;
+  spec->star_precision = false;
+  spec->length = length_none;
+
+  while (*p && strchr("-+ #0", *p))
+    ++p;
+
+  if (*p == '*') {
+    spec->star_width = true;
+    ++p;
+  } else {
+    while (*p >= '0' && *p <= '9')
+      ++p;
+  }
+
+  if (*p == '.') {
+    ++p;
+
+    if (*p == '*') {
+      spec->star_precision = true;
+      ++p;
+    } else {
+      while (*p >= '0' && *p <= '9')
+        ++p;
+    }
+  }
+
+  spec->modifier = p;
+
+  switch (*p) {
+    case 'h':
+      spec->length = (p[1] == 'h') ? length_hh : length_h;
+    break;
+
+    case 'l':
+      spec->length = (p[1] == 'l') ? length_ll : length_l;
+    break;
+
+    case 'z':
+      spec->length = length_z;
+    break;
+
+    case 'j':
+      spec->length = length_j;
+    break;
+
+    case 't':
+      spec->length = length_t;
+    break;
+
+    case 'L':
+      spec->length = length_L;
+    break;
+  }
+
+  if (spec->length == length_hh || spec->length == length_ll)
+    p += 2;
+  else if (spec->length != length_none)
+    p += 1;
+
+  spec->conv = *p;
+  spec->end = *p ? p + 1 : p;
+}
+
+static union log_arg *next_arg(struct log_message *m) {
+  if (m->num_args == log_max_args) {
+    m->truncated = true;
+    return NULL;
+  }
+
+  return &m->args[m->num_args++];
+}
+
+static int64_t get_signed(unsigned length, va_list *args) {
+  switch (length) {
+    case length_hh: return (signed char)va_arg(*args, int);
+    case length_h: return (short)va_arg(*args, int);
+    case length_l: return va_arg(*args, long);
+    case length_ll: return va_arg(*args, long long);
+    case length_z: return va_arg(*args, ssize_t);
+    case length_j: return va_arg(*args, intmax_t);
+    case length_t: return va_arg(*args, ptrdiff_t);
+    default: return va_arg(*args, int);
+  }
+}
+
+static uint64_t get_unsigned(unsigned length, va_list *args) {
+  switch (length) {
+    case length_hh: return (unsigned char)va_arg(*args, unsigned);
+    case length_h: return (unsigned short)va_arg(*args, unsigned);
+    case length_l: return va_arg(*args, unsigned long);
+    case length_ll: return va_arg(*args, unsigned long long);
+    case length_z: return va_arg(*args, size_t);
+    case length_j: return va_arg(*args, uintmax_t);
+    case length_t: return (uint64_t)va_arg(*args, ptrdiff_t);
+    default: return va_arg(*args, unsigned);
+  }
+}
+
+static void copy_string(struct log_message *m, union log_arg *arg, const char *str) {
+  const unsigned space = log_string_size - m->string_size;
+  char *dst = m->strings + m->string_size;
+  unsigned length;
+
+  if (!str) {
+    arg->u = null_string;
+    return;
+  }
+
+  if (space < 4) {
+    arg->u = cut_string;
+    return;
+  }
+
+  length = strnlen(str, space);
+
+  /* Strings that don't fit are cut short. */
+  if (length == space) {
+    length = space - 4;
+    memcpy(dst, str, length);
+    memcpy(dst + length, "...", 3);
+    length += 3;
+  } else {
+    memcpy(dst, str, length);
+  }
+
+  dst[length] = '\0';
+
+  arg->u = m->string_size;
+  m->string_size += length + 1;
+}
+
+/* Copy the arguments of the message. This is all the work the caller *
+ * does, the formatting is left to the writer thread.                 */
+static void capture_args(struct log_message *m, va_list *args) {
+  const char *p = m->fmt;
+  struct log_spec spec;
+  union log_arg *arg;
+
+  m->num_args = 0;
+  m->truncated = false;
+  m->string_size = 0;
+
+  while ((p = strchr(p, '%')) != NULL) {
+    if (p[1] == '%') {
+      p += 2;
+      continue;
+    }
+
+    parse_spec(p, &spec);
+    p = spec.end;
+
+    if (spec.star_width && (arg = next_arg(m)))
+      arg->i = va_arg(*args, int);
+
+    if (spec.star_precision && (arg = next_arg(m)))
+      arg->i = va_arg(*args, int);
+
+    if (m->truncated)
+      return;
+
+    switch (spec.conv) {
+      case 'd': case 'i':
+        if ((arg = next_arg(m)))
+          arg->i = get_signed(spec.length, args);
+      break;
+
+      case 'u': case 'o': case 'x': case 'X':
+        if ((arg = next_arg(m)))
+          arg->u = get_unsigned(spec.length, args);
+      break;
+
+      case 'c':
+        if ((arg = next_arg(m)))
+          arg->i = va_arg(*args, int);
+      break;
+
+      case 'f': case 'F': case 'e': case 'E':
+      case 'g': case 'G': case 'a': case 'A':
+        if ((arg = next_arg(m)))
+          arg->d = (spec.length == length_L) ? (double)va_arg(*args, long double) :
+                                               va_arg(*args, double);
+      break;
+
+      case 's':
+        if ((arg = next_arg(m)))
+          copy_string(m, arg, va_arg(*args, const char *));
+      break;
+
+      case 'p':
+        if ((arg = next_arg(m)))
+          arg->p = va_arg(*args, void *);
+      break;
+
+      case 'n':
+        va_arg(*args, void *);
+      break;
+
+      default:
+        /* Unknown conversion, the type of its argument is unknown too. */
+        m->truncated = true;
+      break;
+    }
+
+    if (m->truncated)
+      return;
+  }
+}
+
+/* Append to the line, which always keeps room for the newline. */
+static void append(char *text, unsigned size, unsigned *length, const char *src, unsigned n) {
+  if (*length + n > size - 1)
+    n = size - 1 - *length;
+
+  memcpy(text + *length, src, n);
+  *length += n;
+}
+
+static void append_printf(char *text, unsigned size, unsigned *length, const char *fmt, ...)
+  __attribute__((format(printf, 4, 5)));
+
+static void append_printf(char *text, unsigned size, unsigned *length, const char *fmt, ...) {
+  const unsigned space = size - 1 - *length;
+  va_list args;
+  int ret;
+
+  if (space == 0)
+    return;
+
+  va_start(args, fmt);
+  ret = vsnprintf(text + *length, space + 1, fmt, args);
+  va_end(args);
+
+  if (ret > 0)
+    *length += ((unsigned)ret > space) ? space : (unsigned)ret;
+}
+
+/* Rebuild the specification for one widened argument, e.g. %08x *
+ * becomes %08llx. Widths and precisions from '*' are filled in.  */
+static bool build_spec(const struct log_spec *spec, const struct log_message *m,
+                       unsigned *arg, const char *length, char *buf, unsigned size) {
+  const char *p;
+  unsigned n = 0;
+  int ret;
+
+  for (p = spec->start; p < spec->modifier; ++p) {
+    if (*p == '*') {
+      if (*arg >= m->num_args)
+        return false;
+
+      ret = snprintf(buf + n, size - n, "%d", (int)m->args[(*arg)++].i);
+    } else {
+      ret = snprintf(buf + n, size - n, "%c", *p);
+    }
+
+    if (ret < 0 || n + ret >= size)
+      return false;
+
+    n += ret;
+  }
+
+  ret = snprintf(buf + n, size - n, "%s%c", length, spec->conv);
+
+  return ret >= 0 && n + ret < size;
+}
+
+/* Format a message into a line, returns its length. */
+static unsigned format_message(const struct log_message *m, char *text, unsigned size) {
+  const char *p = m->fmt;
+  unsigned length = 0;
+  unsigned arg = 0;
+  struct log_spec spec;
+  char buf[32];
+
+  append_printf(text, size, &length, "[%5u.%06u] [%s] %s: ",
+                (unsigned)(m->time / 1000000000ull), (unsigned)(m->time % 1000000000ull / 1000),
+                m->func, level_names[m->level]);
+
+  while (*p) {
+    const char *percent = strchr(p, '%');
+
+    if (!percent) {
+      append(text, size, &length, p, strlen(p));
+      p += strlen(p);
+      break;
+    }
+
+    append(text, size, &length, p, percent - p);
+
+    if (percent[1] == '%') {
+      append(text, size, &length, "%", 1);
+      p = percent + 2;
+      continue;
+    }
+
+    parse_spec(percent, &spec);
+    p = spec.end;
+
+    if (spec.conv == 'n')
+      continue;
+
+    switch (spec.conv) {
+      case 'd': case 'i':
+        if (!build_spec(&spec, m, &arg, "ll", buf, sizeof(buf)) || arg >= m->num_args)
+          goto out;
+
+        append_printf(text, size, &length, buf, (long long)m->args[arg++].i);
+      break;
+
+      case 'u': case 'o': case 'x': case 'X':
+        if (!build_spec(&spec, m, &arg, "ll", buf, sizeof(buf)) || arg >= m->num_args)
+          goto out;
+
+        append_printf(text, size, &length, buf, (unsigned long long)m->args[arg++].u);
+      break;
+
+      case 'c':
+        if (!build_spec(&spec, m, &arg, "", buf, sizeof(buf)) || arg >= m->num_args)
+          goto out;
+
+        append_printf(text, size, &length, buf, (int)m->args[arg++].i);
+      break;
+
+      case 'f': case 'F': case 'e': case 'E':
+      case 'g': case 'G': case 'a': case 'A':
+        if (!build_spec(&spec, m, &arg, "", buf, sizeof(buf)) || arg >= m->num_args)
+          goto out;
+
+        append_printf(text, size, &length, buf, m->args[arg++].d);
+      break;
+
+      case 's': {
+        const char *str;
+
+        if (!build_spec(&spec, m, &arg, "", buf, sizeof(buf)) || arg >= m->num_args)
+          goto out;
+
+        if (m->args[arg].u == null_string)
+          str = "(null)";
+        else if (m->args[arg].u == cut_string)
+          str = "...";
+        else
+          str = m->strings + m->args[arg].u;
+
+        ++arg;
+
+        append_printf(text, size, &length, buf, str);
+      }
+      break;
+
+      case 'p':
+        if (!build_spec(&spec, m, &arg, "", buf, sizeof(buf)) || arg >= m->num_args)
+          goto out;
+
+        append_printf(text, size, &length, buf, m->args[arg++].p);
+      break;
+
+      default:
+        goto out;
+    }
+  }
+
+out:
+  /* The rest of a message with too many arguments is left out. */
+  if (*p)
+    append(text, size, &length, "...", 3);
+
+  if (m->suppressed != 0)
+    append_printf(text, size, &length, " (%u similar messages suppressed)", m->suppressed);
+
+  text[length++] = '\n';
+
+  return length;
+}
+
+/* Reserve the next free entry of the ring, NULL if it is full. */
+static struct log_entry *ring_claim() {
+  uint64_t pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+
+  while (true) {
+    struct log_entry *e = &ring[pos % log_ring_size];
+    const uint64_t turn = __atomic_load_n(&e->turn, __ATOMIC_ACQUIRE);
+    const uint64_t free_turn = 2 * (pos / log_ring_size);
+
+    if (turn == free_turn) {
+      if (__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return e;
+    } else if (turn < free_turn) {
+      /* The writer hasn't caught up with the previous lap. */
+      return NULL;
+    } else {
+      pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/* Hand a claimed entry over to the writer. */
+static void ring_publish(struct log_entry *e) {
+  __atomic_store_n(&e->turn, e->turn + 1, __ATOMIC_RELEASE);
+}
+
+static struct log_entry *ring_peek() {
+  const uint64_t pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+  struct log_entry *e = &ring[pos % log_ring_size];
+
+  if (__atomic_load_n(&e->turn, __ATOMIC_ACQUIRE) != 2 * (pos / log_ring_size) + 1)
+    return NULL;
+
+  return e;
+}
+
+static void ring_pop(struct log_entry *e) {
+  const uint64_t pos = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&e->turn, 2 * (pos / log_ring_size) + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&ring_tail, pos + 1, __ATOMIC_RELEASE);
+}
+
+static void report_dropped() {
+  const unsigned n = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+  char text[64];
+  int length;
+
+  if (n == 0)
+    return;
+
+  length = snprintf(text, sizeof(text), "[log] warning: %u messages dropped\n", n);
+  write_all(text, length);
+}
+
+static void *writer_thread(void *arg) {
+  char text[log_line_size];
+  struct log_entry *e;
+  uint64_t value;
+
+  while (true) {
+    while ((e = ring_peek()) != NULL) {
+      const unsigned length = format_message(&e->msg, text, sizeof(text));
+
+      ring_pop(e);
+      write_all(text, length);
+    }
+
+    report_dropped();
+
+    /* Check again after announcing the wait, so that no wakeup is lost. */
+    __atomic_store_n(&writer_waiting, 1, __ATOMIC_SEQ_CST);
+
+    if (ring_peek() != NULL) {
+      __atomic_store_n(&writer_waiting, 0, __ATOMIC_SEQ_CST);
+      continue;
+    }
+
+    if (read(wake_fd, &value, sizeof(value)) < 0 && errno != EINTR)
+      break;
+  }
+
+  return NULL;
+}
+
+static void writer_start() {
+  pthread_t thread;
+  pthread_attr_t attr;
+
+  wake_fd = eventfd(0, EFD_CLOEXEC);
+  if (wake_fd < 0)
+    return;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  if (pthread_create(&thread, &attr, writer_thread, NULL) == 0)
+    __atomic_store_n(&writer_running, true, __ATOMIC_RELEASE);
+
+  pthread_attr_destroy(&attr);
+}
+
+static void writer_wake() {
+  const uint64_t value = 1;
+
+  if (__atomic_exchange_n(&writer_waiting, 0, __ATOMIC_SEQ_CST) == 0)
+    return;
+
+  if (write(wake_fd, &value, sizeof(value)) < 0) {
+    /* The writer picks the message up with the next one. */
+  }
+}
+
+/* Returns false if the message is over the limit of the call site. */
+static bool rate_check(struct log_site *site, uint64_t now, unsigned *suppressed) {
+  const uint64_t start = __atomic_load_n(&site->window_start, __ATOMIC_RELAXED);
+
+  *suppressed = 0;
+
+  if (start == 0 || now - start >= 1000000000ull) {
+    __atomic_store_n(&site->window_start, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+
+    *suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+  }
+
+  if (__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) > log_burst) {
+    __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+
+  return true;
+}
+
+void log_write(struct log_site *site, int level, const char *func, const char *fmt, ...) {
+  const uint64_t now = get_time_ns();
+  struct log_message local;
+  struct log_message *m = &local;
+  struct log_entry *e = NULL;
+  unsigned suppressed;
+  va_list args;
+  bool running;
+
+  if (!rate_check(site, now, &suppressed))
+    return;
+
+  pthread_once(&writer_once, writer_start);
+  running = __atomic_load_n(&writer_running, __ATOMIC_ACQUIRE);
+
+  /* The message is built in place in the ring. */
+  if (running) {
+    e = ring_claim();
+    if (!e) {
+      __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+
+    m = &e->msg;
+  }
+
+  m->time = now;
+  m->func = func;
+  m->fmt = fmt;
+  m->level = level;
+  m->suppressed = suppressed;
+
+  va_start(args, fmt);
+  capture_args(m, &args);
+  va_end(args);
+
+  /* Without the writer the message goes out synchronously. */
+  if (!running) {
+    char text[log_line_size];
+
+    write_all(text, format_message(m, text, sizeof(text)));
+    return;
+  }
+
+  ring_publish(e);
+  writer_wake();
+}
+
+void log_flush() {
+  const struct timespec delay = { .tv_sec = 0, .tv_nsec = 1000000 };
+  unsigned i;
+
+  if (!__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE))
+    return;
+
+  for (i = 0; i < log_flush_timeout_ms; ++i) {
+    if (__atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) ==
+        __atomic_load_n(&ring_head, __ATOMIC_RELAXED))
+      return;
+
+    nanosleep(&delay, NULL);
+  }
+}
+
+static void __attribute__((constructor)) log_init() {
+  const char *level = getenv("MALI_HOOK_LOG");
+  int i;
+
+  if (!level)
+    return;
+
+  if (strcasecmp(level, "none") == 0) {
+    log_max_level = log_level_none;
+    return;
+  }
+
+  for (i = log_level_error; i <= log_level_debug; ++i) {
+    if (strcasecmp(level, level_names[i]) == 0) {
+      log_max_level = i;
+      return;
+    }
+  }
+
+  fprintf(stderr, "[log_init] warning: unknown log level \"%s\"\n", level);
+}
+
+static void __attribute__((destructor)) log_fini() {
+  log_flush();
+}
@@ -0,0 +1,75 @@
+/* This file is part of mali-fbdev-ioctl.
+ * Copyright (C) 2014-2015 - Tobias Jakobi
+ *
+ * mali-fbdev-ioctl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * mali-fbdev-ioctl is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mali-fbdev-ioctl. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <stdint.h>
+
+/* Asynchronous logging.
+ *
+ * Messages are queued in a lock-free ring, and formatted and written to
+ * stderr by a separate thread, so a slow console doesn't stall the
+ * caller. The caller only copies the arguments (up to 8, and 128 bytes
+ * of strings), so the format has to outlive the call, e.g. a literal.
+ * A full ring drops messages instead of blocking. Each call site is limited to
+ * log_burst messages per second, the number of suppressed messages is
+ * reported with the next one that gets through.
+ *
+ * The level is read from MALI_HOOK_LOG (none, error, warning, info or
+ * debug) and defaults to info (debug for HOOK_VERBOSE builds).
+ *
+ * hook.so and the setup library each get their own copy of the logger,
+ * hence the hidden visibility. */
+
+#define LOG_HIDDEN __attribute__((visibility("hidden")))
+
+enum e_log_level {
+  log_level_none = -1,
+  log_level_error = 0,
+  log_level_warning,
+  log_level_info,
+  log_level_debug
+};
+
+/* Rate limiting state of a call site. */
+struct log_site {
+  uint64_t window_start;
+  unsigned count;
+  unsigned suppressed;
+};
+
+LOG_HIDDEN extern int log_max_level;
+
+LOG_HIDDEN void log_write(struct log_site *site, int level, const char *func,
+                          const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+
+/* Write out all queued messages. */
+LOG_HIDDEN void log_flush();
+
+#define log_at(level, ...) do { \
+    static struct log_site log_site_; \
+    if ((level) <= __atomic_load_n(&log_max_level, __ATOMIC_RELAXED)) \
+      log_write(&log_site_, (level), __func__, __VA_ARGS__); \
+  } while (0)
+
+#define log_error(...) log_at(log_level_error, __VA_ARGS__)
+#define log_warning(...) log_at(log_level_warning, __VA_ARGS__)
+#define log_info(...) log_at(log_level_info, __VA_ARGS__)
+#define log_debug(...) log_at(log_level_debug, __VA_ARGS__)
+
+#endif /* _LOG_H_ */
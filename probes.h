@@ -0,0 +1,61 @@
+/* This file is part of mali-fbdev-ioctl.
+ * Copyright (C) 2014-2015 - Tobias Jakobi
+ *
+ * mali-fbdev-ioctl is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * mali-fbdev-ioctl is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mali-fbdev-ioctl. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+/* Static tracepoints (USDT).
+ *
+ * With <sys/sdt.h> (systemtap-sdt-dev) available, each probe is a single
+ * nop plus an ELF note, which tracing tools (bpftrace, perf, systemtap)
+ * can attach to at runtime, e.g.
+ *   bpftrace -e 'usdt:./hook.so:mali_hook:pan_begin { printf("%d\n", arg0); }'
+ * Without the header, or with NO_PROBES defined, the probes compile to
+ * nothing. The provider is mali_hook, unless PROBE_PROVIDER is defined
+ * before including this header. */
+
+#ifndef PROBE_PROVIDER
+#define PROBE_PROVIDER mali_hook
+#endif
+
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+
+#include <sys/sdt.h>
+
+#define PROBE0(name) DTRACE_PROBE(PROBE_PROVIDER, name)
+#define PROBE1(name, a) DTRACE_PROBE1(PROBE_PROVIDER, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(PROBE_PROVIDER, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(PROBE_PROVIDER, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(PROBE_PROVIDER, name, a, b, c, d)
+
+#else
+
+#define PROBE0(name) do { } while (0)
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#define PROBE4(name, a, b, c, d) do { } while (0)
+
+#endif
+
+#endif /* _PROBES_H_ */
@@ -16,11 +16,16 @@
  */
 
 #include "common.h"
+#include "config.h"
+#include "color.h"
+#include "log.h"
+#include "probes.h"
 
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <assert.h>
+#include <errno.h>
 
 #include <xf86drmMode.h>
 #include <drm_fourcc.h>
@@ -28,17 +33,30 @@
 
 #include <pthread.h>
 #include <poll.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
 
-typedef void (*setupcbfnc)(hsetupfnc, hsetupfnc, hflipfnc, hbufferfnc);
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/dma-buf.h>
+
+typedef struct hook_data* (*setupcbfnc)(hsetupfnc, hsetupfnc, hflipfnc, hbufferfnc);
 
 static pthread_mutex_t hook_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 extern const struct video_config vconf;
 
+/* The effective config: vconf with the runtime overrides applied. */
+static struct video_config cfg;
+static pthread_once_t cfg_once = PTHREAD_ONCE_INIT;
+
 struct exynos_prop {
   uint32_t object_type;
   const char *prop_name;
   uint32_t prop_id;
+  bool optional; /* prop_id is zero if the object lacks the property */
 };
 
 struct exynos_page {
@@ -52,25 +70,171 @@ struct exynos_page {
 
   bool used; /* Set if page is currently used. */
   bool clear; /* Set if page has to be cleared. */
+  bool mapped; /* Set once the page was handed out to the blob. */
+};
+
+/* A small ARGB sprite shown on the cursor plane. The two *
+ * buffers are used alternately, to avoid tearing.         */
+struct exynos_sprite {
+  struct exynos_bo *bo[2];
+  uint32_t buf_id[2];
+  unsigned cur; /* index of the buffer that is (to be) displayed */
+
+  /* Set while the switch to cur is only in the pending request.  *
+   * Otherwise it goes out with the commit of the flip serial.    */
+  bool queued;
+  unsigned serial;
+
+  unsigned width;
+  unsigned height;
+  int x;
+  int y;
+  bool visible;
+};
+
+/* Colour management properties of the CRTC, in the order they are applied. */
+enum e_color_prop {
+  color_degamma = 0,
+  color_ctm,
+  color_gamma,
+  num_color_props
+};
+
+enum {
+  max_overlays = 4,
+  max_layers = 4
+};
+
+/* An overlay plane, with the IDs of the optional properties. */
+struct exynos_overlay {
+  uint32_t plane_id;
+  uint32_t zpos_prop_id; /* zero if not available */
+  uint32_t alpha_prop_id;
+};
+
+/* A client buffer that is scanned out by an overlay plane. */
+struct exynos_layer {
+  bool used;
+  bool visible;
+  bool scanout; /* Set if an overlay plane shows the layer. */
+  bool owns_handle; /* Set if the handle has to be closed with the layer. */
+
+  uint32_t handle;
+  uint32_t buf_id;
+  unsigned width;
+  unsigned height;
+
+  /* destination rectangle on the screen */
+  int x;
+  int y;
+  unsigned w;
+  unsigned h;
+
+  unsigned zpos;
+  unsigned alpha; /* 0 (transparent) to 0xffff (opaque) */
+};
+
+enum {
+  /* Number of frames over which the buffering decision is made. */
+  adaptive_window = 30
+};
+
+enum {
+  /* A flip event that takes longer than this many refresh periods *
+   * (but at least min_flip_timeout ns) is considered lost.         */
+  flip_timeout_periods = 8,
+  min_flip_timeout = 100000000
+};
+
+/* Statistics for switching between double and triple buffering. */
+struct exynos_adaptive {
+  unsigned active_pages; /* 2: wait for each flip, 3: don't */
+
+  uint64_t busy_avg; /* time (ns) the application needs per frame */
+  uint64_t last_return; /* time the previous flip returned to the application */
+
+  unsigned frames;
+  unsigned missed; /* flips that came later than the swap interval */
+  unsigned last_sequence;
 };
 
 struct exynos_fliphandler {
   struct pollfd fds;
   drmEventContext evctx;
+
+  /* The event thread dispatches the DRM events as soon as they arrive. *
+   * Waiters sleep on the condition variable (with hook_mutex).         */
+  pthread_t thread;
+  pthread_cond_t cond;
+  int epoll_fd;
+  int stop_fd;
+  unsigned events; /* number of dispatches so far */
+  bool started;
+  bool running;
 };
 
 struct exynos_drm {
   /* IDs for connector, CRTC and plane objects. */
   uint32_t connector_id;
   uint32_t crtc_id;
+  unsigned crtc_index; /* position in the resources, for vblank requests */
   uint32_t primary_plane_id;
-  uint32_t overlay_plane_id;
+  uint32_t cursor_plane_id;
   uint32_t mode_blob_id;
 
+  /* The currently selected video mode. */
+  drmModeModeInfo mode;
+
+  struct exynos_sprite *sprite;
+
+  struct exynos_overlay overlays[max_overlays];
+  unsigned num_overlays;
+
+  struct exynos_layer layers[max_layers];
+
+  /* Changes (sprite, layers, ...) that still have to be committed. */
+  drmModeAtomicReq *pending_request;
+
+  /* Set while a flip waits for the previous one to complete. */
+  bool flip_queued;
+
+  /* The page of the last flip that was committed. */
+  struct exynos_page *flip_page;
+
+  /* Serials of the last commit with a flip event and of the last *
+   * completed one. A commit is in flight while they differ.      */
+  unsigned flip_serial;
+  unsigned done_serial;
+
+  /* Immediate flips: set if the driver can flip without waiting for *
+   * a vblank, and the newest page waiting for the flip in flight.     */
+  bool async_flip;
+  struct exynos_page *mailbox;
+
+  /* Position of the visible area within the page. */
+  unsigned src_x;
+  unsigned src_y;
+
+  /* Earliest time (ns) of the next flip under the fps cap. */
+  uint64_t next_frame_time;
+
+  struct exynos_adaptive adaptive;
+
+  /* Value of the rotation property of the primary plane. */
+  uint64_t rotation;
+
+  /* Blobs of the colour management properties (zero if unset), *
+   * and the LUT sizes of the hardware.                          */
+  uint32_t color_blobs[num_color_props];
+  unsigned degamma_size;
+  unsigned gamma_size;
+
   struct exynos_prop *properties;
 
-  /* Atomic requests for the initial and the restore modeset. */
+  /* Atomic requests for the initial and the restore modeset. The *
+   * colour blobs go out with a modeset through their own request. */
   drmModeAtomicReq *modeset_request;
+  drmModeAtomicReq *color_request;
   drmModeAtomicReq *restore_request;
 };
 
@@ -81,6 +245,11 @@ static const struct exynos_prop prop_template[] = {
   /* Property IDs of the CRTC object. */
   { DRM_MODE_OBJECT_CRTC, "ACTIVE", 0 },
   { DRM_MODE_OBJECT_CRTC, "MODE_ID", 0 },
+  { DRM_MODE_OBJECT_CRTC, "DEGAMMA_LUT", 0, true },
+  { DRM_MODE_OBJECT_CRTC, "DEGAMMA_LUT_SIZE", 0, true },
+  { DRM_MODE_OBJECT_CRTC, "CTM", 0, true },
+  { DRM_MODE_OBJECT_CRTC, "GAMMA_LUT", 0, true },
+  { DRM_MODE_OBJECT_CRTC, "GAMMA_LUT_SIZE", 0, true },
 
   /* Property IDs of the plane object. */
   { DRM_MODE_OBJECT_PLANE, "FB_ID", 0 },
@@ -92,13 +261,19 @@ static const struct exynos_prop prop_template[] = {
   { DRM_MODE_OBJECT_PLANE, "SRC_X", 0 },
   { DRM_MODE_OBJECT_PLANE, "SRC_Y", 0 },
   { DRM_MODE_OBJECT_PLANE, "SRC_W", 0 },
-  { DRM_MODE_OBJECT_PLANE, "SRC_H", 0 }
+  { DRM_MODE_OBJECT_PLANE, "SRC_H", 0 },
+  { DRM_MODE_OBJECT_PLANE, "rotation", 0, true }
 };
 
 enum e_exynos_prop {
   connector_prop_crtc_id = 0,
   crtc_prop_active,
   crtc_prop_mode_id,
+  crtc_prop_degamma_lut,
+  crtc_prop_degamma_lut_size,
+  crtc_prop_ctm,
+  crtc_prop_gamma_lut,
+  crtc_prop_gamma_lut_size,
   plane_prop_fb_id,
   plane_prop_crtc_id,
   plane_prop_crtc_x,
@@ -108,7 +283,31 @@ enum e_exynos_prop {
   plane_prop_src_x,
   plane_prop_src_y,
   plane_prop_src_w,
-  plane_prop_src_h
+  plane_prop_src_h,
+  plane_prop_rotation
+};
+
+enum e_bringup_state {
+  bringup_none = 0,
+  bringup_running, /* opening device and selecting mode */
+  bringup_configured, /* allocating pages and doing the modeset */
+  bringup_ready,
+  bringup_failed
+};
+
+/* State of the (asynchronous) display bring-up, protected by hook_mutex. */
+struct hook_bringup {
+  pthread_t thread;
+  pthread_cond_t cond;
+  unsigned state;
+};
+
+/* The hook data, as handed to us by the preloader. */
+static struct hook_data *hook_data = NULL;
+
+static struct hook_bringup bringup = {
+  .cond = PTHREAD_COND_INITIALIZER,
+  .state = bringup_none
 };
 
 struct prop_assign {
@@ -116,6 +315,18 @@ struct prop_assign {
   uint64_t value;
 };
 
+static void config_init() {
+  cfg = vconf;
+  config_apply_overrides(&cfg);
+
+  log_info("%ux%u, %u bpp, %u buffers, screen %s",
+          cfg.width, cfg.height, cfg.bpp, cfg.num_buffers, cfg.use_screen ? "on" : "off");
+}
+
+static void config_load() {
+  pthread_once(&cfg_once, config_init);
+}
+
 /* Find the index of a compatible DRM device. */
 static int get_device_index() {
   char buf[32];
@@ -145,10 +356,34 @@ static int get_device_index() {
   return (found ? index : -1);
 }
 
+/* Translate the caching policy from the video config into BO flags. */
+static uint32_t get_bo_flags(unsigned caching, unsigned noncontig) {
+  uint32_t flags = noncontig ? EXYNOS_BO_NONCONTIG : EXYNOS_BO_CONTIG;
+
+  switch (caching) {
+    case bo_caching_wc:
+      flags |= EXYNOS_BO_WC;
+      break;
+
+    case bo_caching_cached:
+      flags |= EXYNOS_BO_CACHABLE;
+      break;
+
+    case bo_caching_none:
+    default:
+      flags |= EXYNOS_BO_NONCACHABLE;
+      break;
+  }
+
+  return flags;
+}
+
 static void clean_up_drm(struct exynos_drm *d, int fd) {
   if (d) {
     drmModeAtomicFree(d->modeset_request);
+    drmModeAtomicFree(d->color_request);
     drmModeAtomicFree(d->restore_request);
+    drmModeAtomicFree(d->pending_request);
   }
 
   free(d);
@@ -170,31 +405,111 @@ static void clean_up_pages(struct exynos_page *p, unsigned cnt) {
   }
 }
 
+static int commit_flush(struct hook_data *data, struct exynos_page *page);
+static unsigned get_swap_interval(const struct hook_data *data);
+static uint64_t get_time_ns();
+static void flip_recover(struct hook_data *data);
+static void sprite_committed(struct exynos_drm *drm, bool dropped, unsigned serial);
+
 /* The main pageflip handler which is used by drmHandleEvent.         *
  * Decreases the pending pageflip count and updates the current page. */
 static void page_flip_handler(int fd, unsigned frame, unsigned sec,
                               unsigned usec, void *data) {
   struct exynos_page *page = data;
+  struct exynos_drm *drm = page->base->drm;
 
-#ifndef NDEBUG
-  fprintf(stderr, "[page_flip_handler] info: page = %p\n", page);
-#endif
+  log_debug("page = %p", page);
 
-  if (page->base->cur_page != NULL) {
+  /* The event of a flip that was given up on may still turn up, *
+   * after the recovery or even after the next flip was issued.  */
+  if (page->base->pageflip_pending == 0 || page != drm->flip_page) {
+    log_debug("dropping stale flip event");
+    return;
+  }
+
+  /* Commits that don't flip (e.g. sprite updates) present the current page again. */
+  if (page->base->cur_page != NULL && page->base->cur_page != page) {
     page->base->cur_page->used = false;
   }
 
   page->base->pageflip_pending--;
+  drm->done_serial++;
+
   page->base->cur_page = page;
+
+  /* Page flips that took longer than the swap interval. */
+  if (drm->adaptive.last_sequence != 0 && frame - drm->adaptive.last_sequence >
+      get_swap_interval(page->base))
+    drm->adaptive.missed++;
+
+  drm->adaptive.last_sequence = frame;
+
+  page->base->flip_sequence = frame;
+  page->base->flip_time = (uint64_t)sec * 1000000000ull + (uint64_t)usec * 1000ull;
+
+  PROBE3(flip_done, page->buf_id, frame, page->base->flip_time);
+
+  /* Changes that came in too late for this vblank go out with the *
+   * next one, unless a flip is about to take them along anyway.   *
+   * A page parked by an immediate flip takes them along as well.  */
+  if (drm->flip_queued || page->base->pageflip_pending != 0)
+    return;
+
+  if (drm->mailbox) {
+    struct exynos_page *next = drm->mailbox;
+
+    drm->mailbox = NULL;
+    if (next != page) {
+      commit_flush(page->base, next);
+      return;
+    }
+  }
+
+  if (drm->pending_request)
+    commit_flush(page->base, page);
+}
+
+/* A flip should complete within a few refresh periods. */
+static uint64_t get_flip_timeout(const struct hook_data *data) {
+  const uint64_t timeout = data->refresh_period * flip_timeout_periods;
+
+  return (timeout < min_flip_timeout) ? min_flip_timeout : timeout;
 }
 
-static void wait_flip(struct exynos_fliphandler *fh) {
-  const int timeout = -1;
+static void wait_flip_event(struct hook_data *data) {
+  struct exynos_fliphandler *fh = data->fliphandler;
+  const uint64_t timeout = get_flip_timeout(data);
+  int ret;
+
+  if (fh->running) {
+    const unsigned events = fh->events;
+    const uint64_t deadline = get_time_ns() + timeout;
+    const struct timespec ts = {
+      .tv_sec = deadline / 1000000000ull,
+      .tv_nsec = deadline % 1000000000ull
+    };
+
+    while (fh->running && fh->events == events) {
+      if (pthread_cond_timedwait(&fh->cond, &hook_mutex, &ts) == ETIMEDOUT) {
+        flip_recover(data);
+        return;
+      }
+    }
+
+    return;
+  }
 
+  /* Without the event thread the caller dispatches the events itself. */
   fh->fds.revents = 0;
 
-  if (poll(&fh->fds, 1, timeout) < 0)
+  ret = poll(&fh->fds, 1, timeout / 1000000ull);
+  if (ret < 0)
+    return;
+
+  if (ret == 0) {
+    flip_recover(data);
     return;
+  }
 
   if (fh->fds.revents & (POLLHUP | POLLERR))
     return;
@@ -203,6 +518,166 @@ static void wait_flip(struct exynos_fliphandler *fh) {
     drmHandleEvent(fh->fds.fd, &fh->evctx);
 }
 
+/* Wait for the next batch of DRM events to be dispatched. If no event *
+ * arrives in time, the flip is considered lost and gets recovered.    *
+ * Has to be called with hook_mutex held.                              */
+static void wait_flip(struct hook_data *data) {
+  PROBE1(wait_flip_begin, data->pageflip_pending);
+
+  wait_flip_event(data);
+
+  PROBE1(wait_flip_end, data->pageflip_pending);
+}
+
+static void *event_thread(void *arg) {
+  struct exynos_fliphandler *fh = arg;
+  struct epoll_event ev;
+
+  while (true) {
+    if (epoll_wait(fh->epoll_fd, &ev, 1, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+
+      log_error("epoll_wait failed (errno = %d)", errno);
+      break;
+    }
+
+    if (ev.data.fd == fh->stop_fd)
+      break;
+
+    if (ev.events & (EPOLLHUP | EPOLLERR)) {
+      log_error("DRM device was closed");
+      break;
+    }
+
+    pthread_mutex_lock(&hook_mutex);
+
+    drmHandleEvent(fh->fds.fd, &fh->evctx);
+    fh->events++;
+
+    pthread_cond_broadcast(&fh->cond);
+    pthread_mutex_unlock(&hook_mutex);
+  }
+
+  /* Waiters fall back to dispatching the events themselves. */
+  pthread_mutex_lock(&hook_mutex);
+  fh->running = false;
+  pthread_cond_broadcast(&fh->cond);
+  pthread_mutex_unlock(&hook_mutex);
+
+  return NULL;
+}
+
+static void event_thread_setup(struct exynos_fliphandler *fh) {
+  if (cfg.event_priority != 0) {
+    struct sched_param param = { .sched_priority = cfg.event_priority };
+    const int ret = pthread_setschedparam(fh->thread, SCHED_FIFO, &param);
+
+    if (ret)
+      log_warning("failed to set realtime priority %u (errno = %d)",
+              cfg.event_priority, ret);
+  }
+
+  if (cfg.event_cpu_mask != 0) {
+    cpu_set_t set;
+    unsigned i;
+    int ret;
+
+    CPU_ZERO(&set);
+
+    for (i = 0; i < sizeof(cfg.event_cpu_mask) * 8; ++i) {
+      if (cfg.event_cpu_mask & (1u << i))
+        CPU_SET(i, &set);
+    }
+
+    ret = pthread_setaffinity_np(fh->thread, sizeof(cpu_set_t), &set);
+    if (ret)
+      log_warning("failed to set CPU affinity 0x%x (errno = %d)",
+              cfg.event_cpu_mask, ret);
+  }
+}
+
+/* Start the event thread. On failure the callers of wait_flip *
+ * dispatch the events themselves, like before.                */
+static void event_thread_start(struct exynos_fliphandler *fh) {
+  struct epoll_event ev = { .events = EPOLLIN };
+  pthread_condattr_t attr;
+
+  fh->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  fh->stop_fd = eventfd(0, EFD_CLOEXEC);
+
+  if (fh->epoll_fd < 0 || fh->stop_fd < 0) {
+    log_warning("failed to create epoll/event fd");
+    goto fail;
+  }
+
+  ev.data.fd = fh->fds.fd;
+  if (epoll_ctl(fh->epoll_fd, EPOLL_CTL_ADD, fh->fds.fd, &ev))
+    goto fail_ctl;
+
+  ev.data.fd = fh->stop_fd;
+  if (epoll_ctl(fh->epoll_fd, EPOLL_CTL_ADD, fh->stop_fd, &ev))
+    goto fail_ctl;
+
+  /* The flip timeout is measured with the monotonic clock. */
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&fh->cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  fh->running = true;
+
+  if (pthread_create(&fh->thread, NULL, event_thread, fh)) {
+    log_warning("failed to create event thread");
+    fh->running = false;
+    pthread_cond_destroy(&fh->cond);
+    goto fail;
+  }
+
+  fh->started = true;
+  event_thread_setup(fh);
+
+  return;
+
+fail_ctl:
+  log_warning("failed to add fd to epoll set");
+
+fail:
+  if (fh->stop_fd >= 0)
+    close(fh->stop_fd);
+
+  if (fh->epoll_fd >= 0)
+    close(fh->epoll_fd);
+
+  fh->stop_fd = -1;
+  fh->epoll_fd = -1;
+}
+
+/* Has to be called with hook_mutex held. */
+static void event_thread_stop(struct exynos_fliphandler *fh) {
+  const uint64_t stop = 1;
+
+  if (!fh->started)
+    return;
+
+  if (write(fh->stop_fd, &stop, sizeof(stop)) != sizeof(stop))
+    log_warning("failed to signal event thread");
+
+  /* The thread needs hook_mutex to exit. */
+  while (fh->running)
+    pthread_cond_wait(&fh->cond, &hook_mutex);
+
+  pthread_join(fh->thread, NULL);
+  pthread_cond_destroy(&fh->cond);
+
+  close(fh->stop_fd);
+  close(fh->epoll_fd);
+
+  fh->stop_fd = -1;
+  fh->epoll_fd = -1;
+  fh->started = false;
+}
+
 /* Get the ID of an object's property using the property name. */
 static bool get_propid_by_name(int fd, uint32_t object_id, uint32_t object_type,
                                const char *name, uint32_t *prop_id) {
@@ -293,7 +768,7 @@ static bool check_connector_type(uint32_t connector_type) {
       break;
   }
 
-  return (t == vconf.connector_type);
+  return (t == cfg.connector_type);
 }
 
 static int exynos_open(struct hook_data *data) {
@@ -316,18 +791,18 @@ static int exynos_open(struct hook_data *data) {
   if (devidx != -1) {
     snprintf(buf, sizeof(buf), "/dev/dri/card%d", devidx);
   } else {
-    fprintf(stderr, "[exynos_open] error: no compatible DRM device found\n");
+    log_error("no compatible DRM device found");
     return -1;
   }
 
   fd = data->open(buf, O_RDWR, 0);
   if (fd < 0) {
-    fprintf(stderr, "[exynos_open] error: failed to open DRM device\n");
+    log_error("failed to open DRM device");
     return -1;
   }
 
-  if (vconf.use_screen == 0) {
-    fprintf(stderr, "[exynos_open] info: skipping screen initialization\n");
+  if (cfg.use_screen == 0) {
+    log_info("skipping screen initialization");
 
     data->drm_fd = fd;
     return 0;
@@ -335,27 +810,27 @@ static int exynos_open(struct hook_data *data) {
 
   /* Request atomic DRM support. This also enables universal planes. */
   if (drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1) < 0) {
-    fprintf(stderr, "[exynos_open] error: failed to enable atomic support\n");
+    log_error("failed to enable atomic support");
     close(fd);
     return -1;
   }
 
   drm = calloc(1, sizeof(struct exynos_drm));
   if (drm == NULL) {
-    fprintf(stderr, "[exynos_open] error: failed to allocate DRM\n");
+    log_error("failed to allocate DRM");
     close(fd);
     return -1;
   }
 
   resources = drmModeGetResources(fd);
   if (resources == NULL) {
-    fprintf(stderr, "[exynos_open] error: failed to get DRM resources\n");
+    log_error("failed to get DRM resources");
     goto fail;
   }
 
   plane_resources = drmModeGetPlaneResources(fd);
   if (plane_resources == NULL) {
-    fprintf(stderr, "[exynos_open] error: failed to get DRM plane resources\n");
+    log_error("failed to get DRM plane resources");
     goto fail;
   }
 
@@ -374,7 +849,7 @@ static int exynos_open(struct hook_data *data) {
   }
 
   if (i == resources->count_connectors) {
-    fprintf(stderr, "[exynos_open] error: no currently active connector found\n");
+    log_error("no currently active connector found");
     goto fail;
   }
 
@@ -400,11 +875,12 @@ static int exynos_open(struct hook_data *data) {
   }
 
   if (i == connector->count_encoders) {
-    fprintf(stderr, "[exynos_open] error: no compatible encoder found\n");
+    log_error("no compatible encoder found");
     goto fail;
   }
 
   drm->crtc_id = resources->crtcs[j];
+  drm->crtc_index = j;
 
   for (i = 0; i < plane_resources->count_planes; ++i) {
     drmModePlane *plane;
@@ -428,7 +904,7 @@ static int exynos_open(struct hook_data *data) {
     switch (type) {
       case DRM_PLANE_TYPE_PRIMARY:
         if (planes[0])
-          fprintf(stderr, "[exynos_open] warn: found more than one primary plane\n");
+          log_warning("found more than one primary plane");
         else
           planes[0] = plane;
         break;
@@ -439,6 +915,17 @@ static int exynos_open(struct hook_data *data) {
         break;
 
       case DRM_PLANE_TYPE_OVERLAY:
+        if (drm->num_overlays < max_overlays) {
+          struct exynos_overlay *o = &drm->overlays[drm->num_overlays++];
+
+          o->plane_id = plane_id;
+          get_propid_by_name(fd, plane_id, DRM_MODE_OBJECT_PLANE, "zpos", &o->zpos_prop_id);
+          get_propid_by_name(fd, plane_id, DRM_MODE_OBJECT_PLANE, "alpha", &o->alpha_prop_id);
+        }
+
+        drmModeFreePlane(plane);
+        break;
+
       default:
         drmModeFreePlane(plane);
         break;
@@ -446,7 +933,7 @@ static int exynos_open(struct hook_data *data) {
   }
 
   if (!planes[0] || !planes[1]) {
-    fprintf(stderr, "[exynos_open] error: no primary plane or overlay plane found\n");
+    log_error("no primary plane or cursor plane found");
     goto fail;
   }
 
@@ -457,16 +944,16 @@ static int exynos_open(struct hook_data *data) {
   }
 
   if (i == planes[0]->count_formats) {
-    fprintf(stderr, "[exynos_open] error: primary plane has no support for XRGB8888\n");
+    log_error("primary plane has no support for XRGB8888");
     goto fail;
   }
 
   drm->primary_plane_id = planes[0]->plane_id;
-  drm->overlay_plane_id = planes[1]->plane_id;
+  drm->cursor_plane_id = planes[1]->plane_id;
 
   fliphandler = calloc(1, sizeof(struct exynos_fliphandler));
   if (fliphandler == NULL) {
-    fprintf(stderr, "[exynos_open] error: failed to allocate fliphandler\n");
+    log_error("failed to allocate fliphandler");
     goto fail;
   }
 
@@ -475,12 +962,16 @@ static int exynos_open(struct hook_data *data) {
   fliphandler->fds.events = POLLIN;
   fliphandler->evctx.version = DRM_EVENT_CONTEXT_VERSION;
   fliphandler->evctx.page_flip_handler = page_flip_handler;
+  fliphandler->epoll_fd = -1;
+  fliphandler->stop_fd = -1;
 
-  fprintf(stderr, "[exynos_open] info: using DRM device \"%s\" with connector id %u\n",
+  log_info("using DRM device \"%s\" with connector id %u",
           buf, drm->connector_id);
 
-  fprintf(stderr, "[exynos_open] info: primary plane has ID %u, overlay plane has ID %u\n",
-          drm->primary_plane_id, drm->overlay_plane_id);
+  log_info("primary plane has ID %u, cursor plane has ID %u",
+          drm->primary_plane_id, drm->cursor_plane_id);
+
+  log_info("%u overlay planes available", drm->num_overlays);
 
   data->drm_fd = fd;
   data->drm = drm;
@@ -545,10 +1036,15 @@ static int exynos_get_properties(int fd, struct exynos_drm *drm) {
 
     uint32_t prop_id;
 
-    if (!get_propid_by_name(fd, object_id, object_type, prop_name, &prop_id))
-      goto fail;
+    if (!get_propid_by_name(fd, object_id, object_type, prop_name, &prop_id)) {
+      if (!prop_template[i].optional)
+        goto fail;
+
+      prop_id = 0;
+    }
 
-    drm->properties[i] = (struct exynos_prop){ object_type, prop_name, prop_id };
+    drm->properties[i] = (struct exynos_prop){ object_type, prop_name, prop_id,
+                                               prop_template[i].optional };
   }
 
   return 0;
@@ -565,12 +1061,14 @@ static int exynos_create_restore_req(int fd, struct exynos_drm *drm) {
     connector_prop_crtc_id,
     crtc_prop_active,
     crtc_prop_mode_id,
+    crtc_prop_degamma_lut, crtc_prop_ctm, crtc_prop_gamma_lut,
     plane_prop_fb_id,
     plane_prop_crtc_id,
     plane_prop_crtc_x, plane_prop_crtc_y,
     plane_prop_crtc_w, plane_prop_crtc_h,
     plane_prop_src_x, plane_prop_src_y,
-    plane_prop_src_w, plane_prop_src_h
+    plane_prop_src_w, plane_prop_src_h,
+    plane_prop_rotation
   };
   const unsigned num_props = sizeof(restore_props) / sizeof(restore_props[0]);
 
@@ -587,6 +1085,9 @@ static int exynos_create_restore_req(int fd, struct exynos_drm *drm) {
 
     uint64_t prop_value;
 
+    if (prop->prop_id == 0)
+      continue;
+
     if (!get_propval_by_id(fd, object_id, object_type, prop->prop_id, &prop_value))
       goto fail;
 
@@ -603,24 +1104,162 @@ fail:
   return -1;
 }
 
-static int exynos_create_modeset_req(int fd, struct exynos_drm *drm, unsigned w, unsigned h) {
+static const enum e_exynos_prop color_props[num_color_props] = {
+  crtc_prop_degamma_lut,
+  crtc_prop_ctm,
+  crtc_prop_gamma_lut
+};
+
+static const char *color_names[num_color_props] = {
+  "degamma", "ctm", "gamma"
+};
+
+static void color_destroy_blobs(int fd, uint32_t *blobs) {
+  unsigned i;
+
+  for (i = 0; i < num_color_props; ++i) {
+    if (blobs[i] != 0)
+      drmModeDestroyPropertyBlob(fd, blobs[i]);
+
+    blobs[i] = 0;
+  }
+}
+
+/* Create the part of the modeset request that applies the colour blobs. */
+static drmModeAtomicReq *color_create_req(const struct exynos_drm *drm, const uint32_t *blobs) {
+  drmModeAtomicReq *request;
+  unsigned i;
+
+  request = drmModeAtomicAlloc();
+  if (!request)
+    return NULL;
+
+  for (i = 0; i < num_color_props; ++i) {
+    if (blobs[i] == 0)
+      continue;
+
+    if (drmModeAtomicAddProperty(request, drm->crtc_id,
+        drm->properties[color_props[i]].prop_id, blobs[i]) < 0) {
+      drmModeAtomicFree(request);
+      return NULL;
+    }
+  }
+
+  return request;
+}
+
+/* Create the property blobs for a colour calibration. The LUTs *
+ * are resampled if their size differs from the hardware.        */
+static int color_create_blobs(int fd, struct exynos_drm *drm,
+                              const struct color_calibration *cal, uint32_t *blobs) {
+  const struct drm_color_lut *luts[num_color_props] = { cal->degamma, NULL, cal->gamma };
+  const unsigned sizes[num_color_props] = { cal->degamma_size, 0, cal->gamma_size };
+  const unsigned hw_sizes[num_color_props] = { drm->degamma_size, 0, drm->gamma_size };
+  unsigned i;
+
+  memset(blobs, 0, num_color_props * sizeof(uint32_t));
+
+  for (i = 0; i < num_color_props; ++i) {
+    struct drm_color_lut *resampled = NULL;
+    const void *blob = (i == color_ctm) ? (const void *)cal->ctm : (const void *)luts[i];
+    size_t size;
+    int ret;
+
+    if (!blob)
+      continue;
+
+    if (drm->properties[color_props[i]].prop_id == 0 || (i != color_ctm && hw_sizes[i] == 0)) {
+      log_error("CRTC doesn't support %s", color_names[i]);
+      goto fail;
+    }
+
+    if (i == color_ctm) {
+      size = sizeof(struct drm_color_ctm);
+    } else {
+      if (sizes[i] != hw_sizes[i]) {
+        resampled = color_resample_lut(luts[i], sizes[i], hw_sizes[i]);
+        if (!resampled) {
+          log_error("failed to resample %s lut", color_names[i]);
+          goto fail;
+        }
+
+        blob = resampled;
+      }
+
+      size = hw_sizes[i] * sizeof(struct drm_color_lut);
+    }
+
+    ret = drmModeCreatePropertyBlob(fd, blob, size, &blobs[i]);
+    free(resampled);
+
+    if (ret) {
+      log_error("failed to create %s blob", color_names[i]);
+      goto fail;
+    }
+  }
+
+  return 0;
+
+fail:
+  color_destroy_blobs(fd, blobs);
+
+  return -1;
+}
+
+/* Query the LUT sizes of the CRTC and load the configured calibration. *
+ * A broken calibration only disables the colour management.          */
+static void color_init(int fd, struct exynos_drm *drm) {
+  struct color_calibration cal;
+  uint32_t prop_id;
+  uint64_t value;
+
+  prop_id = drm->properties[crtc_prop_degamma_lut_size].prop_id;
+  if (prop_id != 0 && get_propval_by_id(fd, drm->crtc_id, DRM_MODE_OBJECT_CRTC, prop_id, &value))
+    drm->degamma_size = value;
+
+  prop_id = drm->properties[crtc_prop_gamma_lut_size].prop_id;
+  if (prop_id != 0 && get_propval_by_id(fd, drm->crtc_id, DRM_MODE_OBJECT_CRTC, prop_id, &value))
+    drm->gamma_size = value;
+
+  if (cfg.calibration[0] == '\0')
+    return;
+
+  if (color_load(cfg.calibration, &cal) == 0) {
+    if (color_create_blobs(fd, drm, &cal, drm->color_blobs) == 0) {
+      log_info("using colour calibration %s", cfg.calibration);
+      color_free(&cal);
+      return;
+    }
+
+    color_free(&cal);
+  }
+
+  log_warning("continuing without colour calibration");
+}
+
+/* The source size is given in framebuffer space, which differs from *
+ * the CRTC size if the plane rotates by 90 or 270 degrees.          */
+static int exynos_create_modeset_req(int fd, struct exynos_drm *drm,
+                                     unsigned src_w, unsigned src_h,
+                                     unsigned crtc_w, unsigned crtc_h) {
   unsigned i;
 
   const struct prop_assign assign[] = {
     { plane_prop_crtc_id, drm->crtc_id },
     { plane_prop_crtc_x, 0 },
     { plane_prop_crtc_y, 0 },
-    { plane_prop_crtc_w, w },
-    { plane_prop_crtc_h, h },
+    { plane_prop_crtc_w, crtc_w },
+    { plane_prop_crtc_h, crtc_h },
     { plane_prop_src_x, 0 },
     { plane_prop_src_y, 0 },
-    { plane_prop_src_w, w << 16 },
-    { plane_prop_src_h, h << 16 }
+    { plane_prop_src_w, src_w << 16 },
+    { plane_prop_src_h, src_h << 16 },
+    { plane_prop_rotation, drm->rotation }
   };
 
   const unsigned num_assign = sizeof(assign) / sizeof(assign[0]);
 
-  assert(!drm->modeset_request);
+  assert(!drm->modeset_request && !drm->color_request);
 
   drm->modeset_request = drmModeAtomicAlloc();
 
@@ -637,11 +1276,18 @@ static int exynos_create_modeset_req(int fd, struct exynos_drm *drm, unsigned w,
     goto fail;
 
   for (i = 0; i < num_assign; ++i) {
+    if (drm->properties[assign[i].prop].prop_id == 0)
+      continue;
+
     if (drmModeAtomicAddProperty(drm->modeset_request, drm->primary_plane_id,
         drm->properties[assign[i].prop].prop_id, assign[i].value) < 0)
       goto fail;
   }
 
+  drm->color_request = color_create_req(drm, drm->color_blobs);
+  if (!drm->color_request)
+    goto fail;
+
   return 0;
 
 fail:
@@ -651,89 +1297,325 @@ fail:
   return -1;
 }
 
-static int exynos_init(struct hook_data *data, unsigned bpp) {
-  struct exynos_drm *drm = data->drm;
-  const int fd = data->drm_fd;
+/* Tolerance for the refresh_exact policy, in mHz. */
+static const unsigned refresh_tolerance = 10;
 
-  drmModeConnector *connector = NULL;
-  drmModeModeInfo *mode = NULL;
-  unsigned i;
+/* Get the (field) refresh rate of a mode in mHz. */
+static unsigned get_mode_refresh(const drmModeModeInfo *mode) {
+  uint64_t num, den;
 
-  if (vconf.use_screen == 0) {
-    fprintf(stderr, "[exynos_init] info: skipping init\n");
+  num = (uint64_t)mode->clock * 1000000;
+  den = (uint64_t)mode->htotal * mode->vtotal;
 
-    data->width = vconf.width;
-    data->height = vconf.height;
+  if (mode->flags & DRM_MODE_FLAG_INTERLACE)
+    num *= 2;
+  if (mode->flags & DRM_MODE_FLAG_DBLSCAN)
+    den *= 2;
+  if (mode->vscan > 1)
+    den *= mode->vscan;
 
-    goto out;
-  }
+  return den ? (unsigned)((num + den / 2) / den) : 0;
+}
 
-  connector = drmModeGetConnector(fd, drm->connector_id);
+static unsigned refresh_distance(unsigned a, unsigned b) {
+  return (a > b) ? a - b : b - a;
+}
 
-  if (vconf.width != 0 && vconf.height != 0) {
-    for (i = 0; i < connector->count_modes; i++) {
-      if (connector->modes[i].hdisplay == vconf.width &&
-          connector->modes[i].vdisplay == vconf.height) {
-        mode = &connector->modes[i];
-        break;
-      }
-    }
+/* A requested refresh rate is matched as closely as possible, unless *
+ * the policy says otherwise. Without one the preferred mode is kept.  */
+static unsigned get_refresh_policy() {
+  if (cfg.refresh_policy == refresh_highest)
+    return refresh_highest;
 
-    if (!mode) {
-      fprintf(stderr, "[exynos_init] error: requested resolution (%dx%d) not available\n",
-              vconf.width, vconf.height);
-      goto fail;
-    }
+  if (cfg.refresh == 0)
+    return refresh_auto;
 
-  } else {
-    /* Select first mode, which is the native one. */
-    mode = &connector->modes[0];
-  }
+  return (cfg.refresh_policy == refresh_auto) ? refresh_closest : cfg.refresh_policy;
+}
 
-  if (mode->hdisplay == 0 || mode->vdisplay == 0) {
-    fprintf(stderr, "[exynos_init] error: failed to select sane resolution\n");
-    goto fail;
-  }
+/* Check if mode a is a better match for the config than mode b. */
+static bool mode_is_better(const drmModeModeInfo *a, const drmModeModeInfo *b) {
+  const unsigned ra = get_mode_refresh(a);
+  const unsigned rb = get_mode_refresh(b);
+  const bool ia = a->flags & DRM_MODE_FLAG_INTERLACE;
+  const bool ib = b->flags & DRM_MODE_FLAG_INTERLACE;
+  const bool pa = a->type & DRM_MODE_TYPE_PREFERRED;
+  const bool pb = b->type & DRM_MODE_TYPE_PREFERRED;
+
+  switch (get_refresh_policy()) {
+    case refresh_auto:
+      if (pa != pb)
+        return pa;
+
+      if (ra != rb)
+        return ra > rb;
+    break;
 
-  if (drmModeCreatePropertyBlob(fd, mode, sizeof(drmModeModeInfo), &drm->mode_blob_id)) {
-    fprintf(stderr, "[exynos_init] error: failed to blobify mode info\n");
-    goto fail;
+    case refresh_highest:
+      if (ra != rb)
+        return ra > rb;
+    break;
+
+    default: {
+      const unsigned da = refresh_distance(ra, cfg.refresh);
+      const unsigned db = refresh_distance(rb, cfg.refresh);
+
+      if (da != db)
+        return da < db;
+    }
+    break;
+  }
+
+  /* Progressive scan beats interlaced with the same rate. */
+  if (ia != ib)
+    return ib;
+
+  return pa && !pb;
+}
+
+/* Select a mode of the connector according to the video config.   *
+ * Without a requested size the size of the preferred mode is used. */
+static drmModeModeInfo *select_mode(drmModeConnector *connector) {
+  drmModeModeInfo *mode = NULL;
+  unsigned w = cfg.width, h = cfg.height;
+  int i;
+
+  if (w == 0 || h == 0) {
+    /* Fall back to the first mode, which is usually the native one. */
+    mode = &connector->modes[0];
+
+    for (i = 0; i < connector->count_modes; ++i) {
+      if (connector->modes[i].type & DRM_MODE_TYPE_PREFERRED) {
+        mode = &connector->modes[i];
+        break;
+      }
+    }
+
+    w = mode->hdisplay;
+    h = mode->vdisplay;
+    mode = NULL;
+  }
+
+  for (i = 0; i < connector->count_modes; ++i) {
+    drmModeModeInfo *m = &connector->modes[i];
+
+    if (m->hdisplay != w || m->vdisplay != h)
+      continue;
+
+    if ((m->flags & DRM_MODE_FLAG_INTERLACE) && !cfg.allow_interlace)
+      continue;
+
+    if (cfg.refresh_policy == refresh_exact && cfg.refresh != 0 &&
+        refresh_distance(get_mode_refresh(m), cfg.refresh) > refresh_tolerance)
+      continue;
+
+    if (!mode || mode_is_better(m, mode))
+      mode = m;
+  }
+
+  return mode;
+}
+
+static bool rotation_swaps_axes() {
+  return cfg.rotation == rotation_90 || cfg.rotation == rotation_270;
+}
+
+/* Translate the configured rotation into the value of the rotation *
+ * property and check that the primary plane supports it.           */
+static int setup_rotation(int fd, struct exynos_drm *drm) {
+  static const char *degrees[] = { "0", "90", "180", "270" };
+  static const uint64_t rotate_bits[] = {
+    DRM_MODE_ROTATE_0, DRM_MODE_ROTATE_90,
+    DRM_MODE_ROTATE_180, DRM_MODE_ROTATE_270
+  };
+
+  const uint32_t prop_id = drm->properties[plane_prop_rotation].prop_id;
+  drmModePropertyRes *prop;
+  uint64_t supported = 0;
+  int i;
+
+  if (cfg.rotation > rotation_270) {
+    log_error("invalid rotation %u", cfg.rotation);
+    return -1;
+  }
+
+  drm->rotation = rotate_bits[cfg.rotation];
+
+  if (cfg.reflect_x)
+    drm->rotation |= DRM_MODE_REFLECT_X;
+
+  if (cfg.reflect_y)
+    drm->rotation |= DRM_MODE_REFLECT_Y;
+
+  if (prop_id == 0) {
+    if (drm->rotation == DRM_MODE_ROTATE_0)
+      return 0;
+
+    log_error("primary plane can't rotate (no rotation property), "
+            "requested %s degrees%s%s", degrees[cfg.rotation],
+            cfg.reflect_x ? ", reflect-x" : "", cfg.reflect_y ? ", reflect-y" : "");
+    return -1;
+  }
+
+  prop = drmModeGetProperty(fd, prop_id);
+  if (!prop) {
+    log_error("failed to query rotation property");
+    return -1;
+  }
+
+  /* The enum values of a bitmask property are bit indices. */
+  if (prop->flags & DRM_MODE_PROP_BITMASK) {
+    for (i = 0; i < prop->count_enums; ++i)
+      supported |= 1ull << prop->enums[i].value;
+  }
+
+  drmModeFreeProperty(prop);
+
+  if ((drm->rotation & supported) != drm->rotation) {
+    log_error("primary plane can't rotate by %s degrees%s%s "
+            "(requested 0x%llx, supported 0x%llx)", degrees[cfg.rotation],
+            cfg.reflect_x ? ", reflect-x" : "", cfg.reflect_y ? ", reflect-y" : "",
+            (unsigned long long)drm->rotation, (unsigned long long)supported);
+    return -1;
+  }
+
+  if (drm->rotation != DRM_MODE_ROTATE_0) {
+    log_info("rotating by %s degrees%s%s", degrees[cfg.rotation],
+            cfg.reflect_x ? ", reflect-x" : "", cfg.reflect_y ? ", reflect-y" : "");
+  }
+
+  return 0;
+}
+
+/* Check if the driver supports atomic commits with DRM_MODE_PAGE_FLIP_ASYNC. */
+static void setup_async_flip(int fd, struct exynos_drm *drm) {
+#ifdef DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP
+  const uint64_t capability = DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP;
+#else
+  /* Older headers only know the cap of the legacy flip ioctl. */
+  const uint64_t capability = DRM_CAP_ASYNC_PAGE_FLIP;
+#endif
+  uint64_t value = 0;
+
+  drm->async_flip = false;
+
+  if (cfg.allow_tearing == 0)
+    return;
+
+  if (drmGetCap(fd, capability, &value) == 0 && value != 0)
+    drm->async_flip = true;
+
+  log_info("immediate flips %s", drm->async_flip ?
+          "use async page flips" : "fall back to the next vblank");
+}
+
+static int exynos_init(struct hook_data *data, unsigned bpp) {
+  struct exynos_drm *drm = data->drm;
+  const int fd = data->drm_fd;
+
+  drmModeConnector *connector = NULL;
+  drmModeModeInfo *mode = NULL;
+
+  if (cfg.use_screen == 0) {
+    log_info("skipping init");
+
+    data->width = cfg.width;
+    data->height = cfg.height;
+
+    goto out;
+  }
+
+  connector = drmModeGetConnector(fd, drm->connector_id);
+
+  mode = select_mode(connector);
+  if (!mode) {
+    log_error("requested mode (%ux%u, %u mHz) not available",
+            cfg.width, cfg.height, cfg.refresh);
+    goto fail;
+  }
+
+  if (mode->hdisplay == 0 || mode->vdisplay == 0) {
+    log_error("failed to select sane resolution");
+    goto fail;
+  }
+
+  if (drmModeCreatePropertyBlob(fd, mode, sizeof(drmModeModeInfo), &drm->mode_blob_id)) {
+    log_error("failed to blobify mode info");
+    goto fail;
   }
 
   if (exynos_get_properties(fd, drm)) {
-    fprintf(stderr, "[exynos_init] error: failed to get object properties\n");
+    log_error("failed to get object properties");
     goto fail;
   }
 
   if (exynos_create_restore_req(fd, drm)) {
-    fprintf(stderr, "[exynos_init] error: failed to create restore atomic request\n");
+    log_error("failed to create restore atomic request");
     goto fail;
   }
 
-  if (exynos_create_modeset_req(fd, drm, mode->hdisplay, mode->vdisplay)) {
-    fprintf(stderr, "[exynos_init] error: failed to create modeset atomic request\n");
+  if (setup_rotation(fd, drm))
+    goto fail;
+
+  color_init(fd, drm);
+  setup_async_flip(fd, drm);
+
+  /* The framebuffer is laid out in the orientation of the content. */
+  data->width = rotation_swaps_axes() ? mode->vdisplay : mode->hdisplay;
+  data->height = rotation_swaps_axes() ? mode->hdisplay : mode->vdisplay;
+
+  if (exynos_create_modeset_req(fd, drm, data->width, data->height,
+                                mode->hdisplay, mode->vdisplay)) {
+    log_error("failed to create modeset atomic request");
     goto fail;
   }
 
-  data->width = mode->hdisplay;
-  data->height = mode->vdisplay;
+  drm->mode = *mode;
+
+  if (get_mode_refresh(mode) != 0)
+    data->refresh_period = 1000000000000ull / get_mode_refresh(mode);
+
+  log_info("using mode \"%s\" at %u.%03u Hz%s",
+          mode->name, get_mode_refresh(mode) / 1000, get_mode_refresh(mode) % 1000,
+          (mode->flags & DRM_MODE_FLAG_INTERLACE) ? " (interlaced)" : "");
 
   drmModeFreeConnector(connector);
 
 out:
-  data->num_pages = vconf.num_buffers != 0 ? vconf.num_buffers : 2;
+  if (cfg.front_buffer)
+    data->num_pages = 1;
+  else
+    data->num_pages = cfg.num_buffers != 0 ? cfg.num_buffers : 2;
+
+  /* num_buffers is the maximum here, start out with double buffering. */
+  if (cfg.adaptive_buffering && !cfg.front_buffer) {
+    if (data->num_pages < 3)
+      data->num_pages = 3;
+
+    if (drm)
+      drm->adaptive = (struct exynos_adaptive){ .active_pages = 2 };
+  }
 
   data->bpp = bpp;
-  data->pitch = bpp * data->width;
-  data->size = data->pitch * data->height;
+  data->virt_width = (cfg.virtual_width > data->width) ? cfg.virtual_width : data->width;
+  data->virt_height = (cfg.virtual_height > data->height) ? cfg.virtual_height : data->height;
 
-  fprintf(stderr, "[exynos_init] info: selected %ux%u resolution with %u bpp\n",
+  data->pitch = bpp * data->virt_width;
+  data->size = data->pitch * data->virt_height;
+
+  log_info("selected %ux%u resolution with %u bpp",
           data->width, data->height, data->bpp);
 
+  if (data->virt_width != data->width || data->virt_height != data->height) {
+    log_info("using %ux%u virtual pages for panning",
+            data->virt_width, data->virt_height);
+  }
+
   return 0;
 
 fail:
   drmModeDestroyPropertyBlob(fd, drm->mode_blob_id);
+  color_destroy_blobs(fd, drm->color_blobs);
   drmModeFreeConnector(connector);
 
   return -1;
@@ -741,11 +1623,17 @@ fail:
 
 /* Counterpart to exynos_init. */
 static void exynos_deinit(struct hook_data *data) {
-  if (data->drm)
+  if (data->drm) {
     drmModeDestroyPropertyBlob(data->drm_fd, data->drm->mode_blob_id);
+    color_destroy_blobs(data->drm_fd, data->drm->color_blobs);
+  }
+
+  data->refresh_period = 0;
 
   data->width = 0;
   data->height = 0;
+  data->virt_width = 0;
+  data->virt_height = 0;
 
   data->bpp = 0;
   data->pitch = 0;
@@ -766,14 +1654,20 @@ static int exynos_create_page_req(struct exynos_page *p) {
     goto fail;
 
   if (drmModeAtomicAddProperty(p->atomic_request, drm->primary_plane_id,
-      drm->properties[plane_prop_fb_id].prop_id, p->buf_id) < 0) {
-    drmModeAtomicFree(p->atomic_request);
-    p->atomic_request = NULL;
-    goto fail;
-  }
+      drm->properties[plane_prop_fb_id].prop_id, p->buf_id) < 0)
+    goto fail_req;
+
+  if (drm->properties[plane_prop_rotation].prop_id != 0 &&
+      drmModeAtomicAddProperty(p->atomic_request, drm->primary_plane_id,
+      drm->properties[plane_prop_rotation].prop_id, drm->rotation) < 0)
+    goto fail_req;
 
   return 0;
 
+fail_req:
+  drmModeAtomicFree(p->atomic_request);
+  p->atomic_request = NULL;
+
 fail:
   return -1;
 }
@@ -788,19 +1682,92 @@ static int initial_modeset(int fd, struct exynos_page *page, struct exynos_drm *
     goto out;
   }
 
+  if (drmModeAtomicMerge(request, drm->color_request)) {
+    ret = -2;
+    goto out;
+  }
+
   if (drmModeAtomicMerge(request, page->atomic_request)) {
     ret = -2;
     goto out;
   }
 
-  if (drmModeAtomicCommit(fd, request, DRM_MODE_ATOMIC_ALLOW_MODESET, NULL))
+  if (drm->pending_request && drmModeAtomicMerge(request, drm->pending_request)) {
+    ret = -2;
+    goto out;
+  }
+
+  if (drmModeAtomicCommit(fd, request, DRM_MODE_ATOMIC_ALLOW_MODESET, NULL)) {
     ret = -3;
+    goto out;
+  }
+
+  drmModeAtomicFree(drm->pending_request);
+  drm->pending_request = NULL;
+
+  sprite_committed(drm, false, drm->done_serial);
 
 out:
   drmModeAtomicFree(request);
   return ret;
 }
 
+/* Recover from a flip event that never arrived, e.g. because the CRTC *
+ * was reset or went through a DPMS cycle. The flip is redone with a    *
+ * blocking commit (or a full modeset if the CRTC lost its mode).       */
+static void flip_recover(struct hook_data *data) {
+  struct exynos_drm *drm = data->drm;
+  struct exynos_page *page = drm->flip_page;
+  drmModeCrtc *crtc;
+  bool active = false;
+  int ret = -1;
+
+  data->stats.flip_timeouts++;
+
+  crtc = drmModeGetCrtc(data->drm_fd, drm->crtc_id);
+  if (crtc) {
+    active = crtc->mode_valid && crtc->buffer_id != 0;
+    drmModeFreeCrtc(crtc);
+  }
+
+  PROBE1(flip_timeout, active);
+
+  log_warning("flip event timed out (CRTC %s)",
+          active ? "active" : "inactive");
+
+  /* Nothing is in flight anymore as far as we are concerned. */
+  data->pageflip_pending = 0;
+  drm->done_serial = drm->flip_serial;
+  drm->mailbox = NULL;
+
+  if (page == NULL)
+    return;
+
+  if (active)
+    ret = drmModeAtomicCommit(data->drm_fd, page->atomic_request, 0, NULL);
+
+  if (ret) {
+    ret = initial_modeset(data->drm_fd, page, drm);
+
+    /* The modeset resets the viewport of the primary plane. */
+    if (ret == 0)
+      drm->src_x = drm->src_y = 0;
+  }
+
+  if (ret) {
+    log_error("failed to restore the display");
+    return;
+  }
+
+  if (data->cur_page != NULL && data->cur_page != page)
+    data->cur_page->used = false;
+
+  data->cur_page = page;
+  data->flip_time = get_time_ns();
+
+  data->stats.flip_recoveries++;
+}
+
 static int exynos_alloc(struct hook_data *data) {
   struct exynos_device *device;
   struct exynos_bo *bo;
@@ -808,31 +1775,31 @@ static int exynos_alloc(struct hook_data *data) {
   struct drm_prime_handle req = { 0 };
   unsigned i;
 
-  const unsigned flags = 0;
+  const uint32_t bo_flags = get_bo_flags(cfg.bo_caching, cfg.bo_noncontig);
 
   device = exynos_device_create(data->drm_fd);
   if (device == NULL) {
-    fprintf(stderr, "[exynos_alloc] error: failed to create device from fd\n");
+    log_error("failed to create device from fd");
     return -1;
   }
 
   pages = calloc(data->num_pages, sizeof(struct exynos_page));
   if (pages == NULL) {
-    fprintf(stderr, "[exynos_alloc] error: failed to allocate pages\n");
+    log_error("failed to allocate pages");
     goto fail_alloc;
   }
 
   for (i = 0; i < data->num_pages; ++i) {
-    bo = exynos_bo_create(device, data->size, flags);
+    bo = exynos_bo_create(device, data->size, bo_flags);
     if (bo == NULL) {
-      fprintf(stderr, "[exynos_alloc] error: failed to create buffer object\n");
+      log_error("failed to create buffer object");
       goto fail;
     }
 
     req.handle = bo->handle;
 
     if (drmIoctl(data->drm_fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &req) < 0) {
-      fprintf(stderr, "[exynos_alloc] error: failed to get fd from bo\n");
+      log_error("failed to get fd from bo");
       exynos_bo_destroy(bo);
       goto fail;
     }
@@ -847,7 +1814,7 @@ static int exynos_alloc(struct hook_data *data) {
     pages[i].clear = true;
   }
 
-  if (vconf.use_screen == 1) {
+  if (cfg.use_screen == 1) {
     const uint32_t pixel_format = (data->bpp == 2) ? DRM_FORMAT_RGB565 : DRM_FORMAT_XRGB8888;
     uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
 
@@ -857,29 +1824,35 @@ static int exynos_alloc(struct hook_data *data) {
     for (i = 0; i < data->num_pages; ++i) {
       handles[0] = pages[i].bo->handle;
 
-      if (drmModeAddFB2(data->drm_fd, data->width, data->height,
+      if (drmModeAddFB2(data->drm_fd, data->virt_width, data->virt_height,
                         pixel_format, handles, pitches, offsets,
-                        &pages[i].buf_id, flags)) {
-        fprintf(stderr, "[exynos_alloc] error: failed to add bo %u to fb\n", i);
+                        &pages[i].buf_id, 0)) {
+        log_error("failed to add bo %u to fb", i);
         goto fail;
       }
 
       if (exynos_create_page_req(&pages[i])) {
-        fprintf(stderr, "[exynos_alloc] error: failed to create atomic request for page %u\n", i);
+        log_error("failed to create atomic request for page %u", i);
         goto fail;
       }
     }
 
     /* Setup framebuffer: display the last allocated page. */
     if (initial_modeset(data->drm_fd, &pages[data->num_pages - 1], data->drm)) {
-      fprintf(stderr, "[exynos_alloc] error: initial atomic modeset failed\n");
+      log_error("initial atomic modeset failed");
       goto fail;
     }
+
+    /* No flip event reports this page, e.g. the front buffer is never flipped. */
+    data->cur_page = &pages[data->num_pages - 1];
   }
 
   data->pages = pages;
   data->device = device;
 
+  if (cfg.use_screen == 1 && data->fliphandler)
+    event_thread_start(data->fliphandler);
+
   return 0;
 
 fail:
@@ -891,153 +1864,925 @@ fail_alloc:
   return -1;
 }
 
-/* Counterpart to exynos_alloc. */
-static void exynos_free(struct hook_data *data) {
-  if (vconf.use_screen == 1) {
-    /* Disable/restore the display. */
-    if (drmModeAtomicCommit(data->drm_fd, data->drm->restore_request,
-        DRM_MODE_ATOMIC_ALLOW_MODESET, NULL)) {
-      fprintf(stderr, "[exynos_free] warning: failed to disable/restore the display\n");
-    }
+/* Add a property change to the pending request. All changes from the *
+ * various callers go out together with the next commit.              */
+static int commit_add(struct exynos_drm *drm, uint32_t object_id,
+                      uint32_t prop_id, uint64_t value) {
+  if (!drm->pending_request) {
+    drm->pending_request = drmModeAtomicAlloc();
+    if (!drm->pending_request)
+      return -1;
   }
 
-  clean_up_pages(data->pages, data->num_pages);
+  return (drmModeAtomicAddProperty(drm->pending_request, object_id, prop_id, value) < 0) ? -1 : 0;
+}
 
-  free(data->pages);
-  data->pages = NULL;
+static void sprite_destroy(struct exynos_drm *drm, int fd) {
+  struct exynos_sprite *sprite = drm->sprite;
+  unsigned i;
 
-  exynos_device_destroy(data->device);
-  data->device = NULL;
-}
+  if (!sprite)
+    return;
 
-static int exynos_flip(struct hook_data *data, struct exynos_page *page) {
-  /* We don't queue multiple page flips. */
-  if (data->pageflip_pending > 0) {
-    wait_flip(data->fliphandler);
-  }
+  for (i = 0; i < 2; ++i) {
+    if (sprite->buf_id[i] != 0)
+      drmModeRmFB(fd, sprite->buf_id[i]);
 
-  /* Issue a page flip at the next vblank interval. */
-  if (drmModeAtomicCommit(data->drm_fd, page->atomic_request,
-                          DRM_MODE_PAGE_FLIP_EVENT, page)) {
-    fprintf(stderr, "[exynos_flip] error: failed to issue atomic page flip\n");
-    return -1;
-  } else {
-    data->pageflip_pending++;
+    if (sprite->bo[i] != NULL)
+      exynos_bo_destroy(sprite->bo[i]);
   }
 
-  /* On startup no frame is displayed. We therefore wait for the initial flip to finish. */
-  if (data->cur_page == NULL) wait_flip(data->fliphandler);
-
-  return 0;
+  free(sprite);
+  drm->sprite = NULL;
 }
 
-static void init_var_screeninfo(struct hook_data *data) {
-  if (data->fake_vscreeninfo) return;
+/* The pending changes went out with the commit of the given serial, *
+ * or were dropped. Keeps track of the sprite buffer on screen.      */
+static void sprite_committed(struct exynos_drm *drm, bool dropped, unsigned serial) {
+  struct exynos_sprite *sprite = drm->sprite;
 
-  const struct fb_var_screeninfo vscreeninfo = {
-    .xres = data->width,
-    .yres = data->height,
-    .xres_virtual = data->width,
-    .yres_virtual = data->height * data->num_pages,
-    .bits_per_pixel = data->bpp * 8,
-    .red = {
-      .offset = 16,
-      .length = 8
-    },
-    .green = {
-      .offset = 8,
-      .length = 8
-    },
-    .blue = {
-      .offset = 0,
-      .length = 8
-    },
-    .transp = {
-      .offset = 0,
-      .length = 0
-    },
-    .height = 0xffffffff,
-    .width = 0xffffffff,
-    .accel_flags = 1
-  };
+  if (!sprite || !sprite->queued)
+    return;
 
-  data->fake_vscreeninfo = malloc(sizeof(struct fb_var_screeninfo));
-  memcpy(data->fake_vscreeninfo, &vscreeninfo, sizeof(struct fb_var_screeninfo));
-}
+  /* The previous buffer stays on screen. */
+  if (dropped) {
+    sprite->cur ^= 1;
+    serial = drm->done_serial;
+  }
 
-static void init_fix_screeninfo(struct hook_data *data) {
-  if (data->fake_fscreeninfo) return;
+  sprite->queued = false;
+  sprite->serial = serial;
+}
 
-  const struct fb_fix_screeninfo fscreeninfo = {
-    .smem_start = data->base_addr,
-    .smem_len = 0,
-    .visual = FB_VISUAL_TRUECOLOR,
-    .xpanstep = 1,
-    .ypanstep = 1,
-    .line_length = data->pitch
-  };
+/* Check if the buffer the sprite is switching away from (cur ^ 1) *
+ * may still be scanned out.                                       */
+static bool sprite_busy(const struct exynos_drm *drm) {
+  const struct exynos_sprite *sprite = drm->sprite;
 
-  data->fake_fscreeninfo = malloc(sizeof(struct fb_fix_screeninfo));
-  memcpy(data->fake_fscreeninfo, &fscreeninfo, sizeof(struct fb_fix_screeninfo));
+  return sprite->queued || (int)(sprite->serial - drm->done_serial) > 0;
 }
 
-static int hook_initialize(struct hook_data *data) {
-  int ret;
-
-  pthread_mutex_lock(&hook_mutex);
+static int sprite_create(struct hook_data *data, unsigned width, unsigned height) {
+  struct exynos_sprite *sprite;
+  uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
+  unsigned i;
 
-  if (data->initialized) return 0;
+  /* The sprite is only written by the CPU. */
+  const uint32_t bo_flags = get_bo_flags(bo_caching_wc, 0);
 
-  if (vconf.bpp != 0 && vconf.bpp != 4) {
-    fprintf(stderr, "[hook_initialize] error: only bpp=4 supported at the moment\n");
-    goto fail;
-  }
+  sprite = calloc(1, sizeof(struct exynos_sprite));
+  if (!sprite)
+    return -1;
 
-  if (exynos_open(data)) {
-    fprintf(stderr, "[hook_initialize] error: opening device failed\n");
-    goto fail;
-  }
+  data->drm->sprite = sprite;
 
-  if (exynos_init(data, vconf.bpp != 0 ? vconf.bpp : 4) != 0) {
-    fprintf(stderr, "[hook_initialize] error: initialization failed\n");
-    goto fail_init;
-  }
+  sprite->serial = data->drm->done_serial;
+  sprite->width = width;
+  sprite->height = height;
+  pitches[0] = width * 4;
 
-  if (exynos_alloc(data)) {
-    fprintf(stderr, "[hook_initialize] error: allocation failed\n");
-    goto fail_alloc;
-  }
+  for (i = 0; i < 2; ++i) {
+    sprite->bo[i] = exynos_bo_create(data->device, pitches[0] * height, bo_flags);
+    if (!sprite->bo[i] || !exynos_bo_map(sprite->bo[i]))
+      goto fail;
 
-  data->base_addr = 0x67900000;
+    handles[0] = sprite->bo[i]->handle;
 
-  init_var_screeninfo(data);
-  init_fix_screeninfo(data);
+    if (drmModeAddFB2(data->drm_fd, width, height, DRM_FORMAT_ARGB8888,
+                      handles, pitches, offsets, &sprite->buf_id[i], 0))
+      goto fail;
+  }
 
-  data->initialized = 1;
+  return 0;
 
-  ret = 0;
-  goto out;
+fail:
+  sprite_destroy(data->drm, data->drm_fd);
+  return -1;
+}
 
-fail_alloc:
-  exynos_deinit(data);
+/* Queue the current sprite state for the next commit. */
+static int sprite_queue(struct hook_data *data) {
+  struct exynos_drm *drm = data->drm;
+  const struct exynos_sprite *sprite = drm->sprite;
+  const uint32_t plane_id = drm->cursor_plane_id;
+  unsigned i;
 
-fail_init:
-  exynos_close(data);
+  /* The standard plane properties are shared between all *
+   * planes, so the IDs of the primary plane apply here.  */
+  const struct prop_assign assign[] = {
+    { plane_prop_fb_id, sprite->visible ? sprite->buf_id[sprite->cur] : 0 },
+    { plane_prop_crtc_id, sprite->visible ? drm->crtc_id : 0 },
+    { plane_prop_crtc_x, (uint64_t)(int64_t)sprite->x },
+    { plane_prop_crtc_y, (uint64_t)(int64_t)sprite->y },
+    { plane_prop_crtc_w, sprite->width },
+    { plane_prop_crtc_h, sprite->height },
+    { plane_prop_src_x, 0 },
+    { plane_prop_src_y, 0 },
+    { plane_prop_src_w, sprite->width << 16 },
+    { plane_prop_src_h, sprite->height << 16 }
+  };
 
-fail:
-  ret = -1;
+  const unsigned num_assign = sizeof(assign) / sizeof(assign[0]);
 
-out:
-  pthread_mutex_unlock(&hook_mutex);
+  for (i = 0; i < num_assign; ++i) {
+    if (commit_add(drm, plane_id, drm->properties[assign[i].prop].prop_id, assign[i].value))
+      return -1;
+  }
 
-  return ret;
+  return 0;
 }
 
-static int hook_free(struct hook_data *data) {
+/* Issue a single commit that presents the page and carries all     *
+ * pending changes. Completion is signalled through the flip handler. */
+static int commit_flush(struct hook_data *data, struct exynos_page *page) {
+  struct exynos_drm *drm = data->drm;
+  drmModeAtomicReq *request = page->atomic_request;
+  const uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
+  bool dropped = false;
+  int ret;
+
+  if (drm->pending_request) {
+    request = drmModeAtomicDuplicate(page->atomic_request);
+
+    if (!request || drmModeAtomicMerge(request, drm->pending_request)) {
+      log_warning("failed to merge pending changes");
+      drmModeAtomicFree(request);
+      request = page->atomic_request;
+    }
+  }
+
+  ret = drmModeAtomicCommit(data->drm_fd, request, flags, page);
+
+  if (request != page->atomic_request) {
+    drmModeAtomicFree(request);
+
+    /* Don't let broken changes block the flip. */
+    if (ret && errno != EBUSY) {
+      log_warning("dropping pending changes");
+      ret = drmModeAtomicCommit(data->drm_fd, page->atomic_request, flags, page);
+      dropped = true;
+    }
+
+    if (ret == 0) {
+      drmModeAtomicFree(drm->pending_request);
+      drm->pending_request = NULL;
+
+      sprite_committed(drm, dropped, drm->flip_serial + 1);
+    }
+  }
+
+  if (ret)
+    return -1;
+
+  data->pageflip_pending++;
+  drm->flip_page = page;
+  drm->flip_serial++;
+
+  PROBE2(commit, page->buf_id, data->pageflip_pending);
+
+  return 0;
+}
+
+/* Commit the pending changes right away if the display is idle.  *
+ * Otherwise they are coalesced and go out with the next commit,  *
+ * i.e. with the next flip or at the next vblank.                 */
+static int commit_schedule(struct hook_data *data) {
+  if (!data->drm->pending_request)
+    return 0;
+
+  if (data->pageflip_pending > 0 || data->cur_page == NULL)
+    return 0;
+
+  /* This presents the current page again, which keeps the *
+   * flip accounting intact.                               */
+  if (commit_flush(data, data->cur_page) && errno != EBUSY)
+    return -1;
+
+  return 0;
+}
+
+/* Commit the pending plane changes and wait until they are applied. */
+static int pending_flush(struct hook_data *data) {
+  struct exynos_drm *drm = data->drm;
+  int ret;
+
+  while (data->pageflip_pending > 0)
+    wait_flip(data);
+
+  if (!drm->pending_request)
+    return 0;
+
+  ret = drmModeAtomicCommit(data->drm_fd, drm->pending_request, 0, NULL);
+
+  drmModeAtomicFree(drm->pending_request);
+  drm->pending_request = NULL;
+
+  sprite_committed(drm, ret != 0, drm->done_serial);
+
+  return ret ? -1 : 0;
+}
+
+/* Importing a dma-buf returns the existing handle if the buffer is *
+ * already known to the DRM fd. Only a handle that no page, no other *
+ * layer and (as far as we know) not the application uses is ours.  */
+static bool layer_handle_unused(struct hook_data *data, const struct exynos_layer *layer) {
+  unsigned i;
+
+  if (__atomic_load_n(&data->drm_fd_shared, __ATOMIC_ACQUIRE))
+    return false;
+
+  for (i = 0; i < data->num_pages; ++i) {
+    if (data->pages && data->pages[i].bo &&
+        data->pages[i].bo->handle == layer->handle)
+      return false;
+  }
+
+  for (i = 0; i < max_layers; ++i) {
+    const struct exynos_layer *l = &data->drm->layers[i];
+
+    if (l != layer && l->used && l->handle == layer->handle)
+      return false;
+  }
+
+  return true;
+}
+
+static void layer_release(struct hook_data *data, struct exynos_layer *layer) {
+  struct drm_gem_close req = { 0 };
+  unsigned i;
+
+  if (layer->buf_id != 0)
+    drmModeRmFB(data->drm_fd, layer->buf_id);
+
+  if (layer->owns_handle) {
+    /* Another layer of the same buffer takes the handle over. */
+    for (i = 0; i < max_layers; ++i) {
+      struct exynos_layer *l = &data->drm->layers[i];
+
+      if (l != layer && l->used && l->handle == layer->handle) {
+        l->owns_handle = true;
+        layer->owns_handle = false;
+        break;
+      }
+    }
+  }
+
+  if (layer->owns_handle) {
+    req.handle = layer->handle;
+    drmIoctl(data->drm_fd, DRM_IOCTL_GEM_CLOSE, &req);
+  }
+
+  memset(layer, 0, sizeof(struct exynos_layer));
+}
+
+/* Assign the overlay planes to the visible layers, in the order *
+ * of the layer's z-position, and queue the resulting plane state. */
+static int layers_queue(struct hook_data *data) {
+  struct exynos_drm *drm = data->drm;
+  struct exynos_layer *order[max_layers];
+  unsigned num_order = 0;
+  unsigned i, j;
+
+  for (i = 0; i < max_layers; ++i) {
+    struct exynos_layer *layer = &drm->layers[i];
+
+    layer->scanout = false;
+
+    if (!layer->used || !layer->visible)
+      continue;
+
+    /* Insertion sort by z-position. */
+    for (j = num_order; j > 0 && order[j - 1]->zpos > layer->zpos; --j)
+      order[j] = order[j - 1];
+
+    order[j] = layer;
+    ++num_order;
+  }
+
+  for (i = 0; i < drm->num_overlays; ++i) {
+    const struct exynos_overlay *o = &drm->overlays[i];
+    struct exynos_layer *layer = (i < num_order) ? order[i] : NULL;
+    const bool on = (layer != NULL);
+
+    const struct prop_assign assign[] = {
+      { plane_prop_fb_id, on ? layer->buf_id : 0 },
+      { plane_prop_crtc_id, on ? drm->crtc_id : 0 },
+      { plane_prop_crtc_x, on ? (uint64_t)(int64_t)layer->x : 0 },
+      { plane_prop_crtc_y, on ? (uint64_t)(int64_t)layer->y : 0 },
+      { plane_prop_crtc_w, on ? layer->w : 0 },
+      { plane_prop_crtc_h, on ? layer->h : 0 },
+      { plane_prop_src_x, 0 },
+      { plane_prop_src_y, 0 },
+      { plane_prop_src_w, on ? layer->width << 16 : 0 },
+      { plane_prop_src_h, on ? layer->height << 16 : 0 }
+    };
+
+    const unsigned num_assign = sizeof(assign) / sizeof(assign[0]);
+
+    for (j = 0; j < num_assign; ++j) {
+      if (commit_add(drm, o->plane_id, drm->properties[assign[j].prop].prop_id, assign[j].value))
+        return -1;
+    }
+
+    if (!on)
+      continue;
+
+    /* The primary plane is at the bottom. */
+    if (o->zpos_prop_id != 0 && commit_add(drm, o->plane_id, o->zpos_prop_id, i + 1))
+      return -1;
+
+    if (o->alpha_prop_id != 0 && commit_add(drm, o->plane_id, o->alpha_prop_id, layer->alpha))
+      return -1;
+
+    layer->scanout = true;
+  }
+
+  return 0;
+}
+
+/* Check if the display controller accepts the pending plane changes. */
+static bool pending_test(struct hook_data *data) {
+  return drmModeAtomicCommit(data->drm_fd, data->drm->pending_request,
+                             DRM_MODE_ATOMIC_TEST_ONLY, NULL) == 0;
+}
+
+/* Queue the layers and check the result. If the changed layer can't *
+ * be scanned out, it is left to GPU composition.                     */
+static int layers_update(struct hook_data *data, struct exynos_layer *changed) {
+  struct exynos_drm *drm = data->drm;
+  const int cursor = drm->pending_request ? drmModeAtomicGetCursor(drm->pending_request) : 0;
+
+  /* A hidden layer doesn't need to be composed either. */
+  if (layers_queue(data) == 0 && pending_test(data))
+    return (changed->scanout || !changed->visible) ? 0 : 1;
+
+  /* Roll back to the state before the change and drop the layer from scanout. */
+  if (drm->pending_request)
+    drmModeAtomicSetCursor(drm->pending_request, cursor);
+
+  changed->visible = false;
+
+  if (layers_queue(data) || !pending_test(data)) {
+    log_error("plane configuration rejected");
+
+    if (drm->pending_request)
+      drmModeAtomicSetCursor(drm->pending_request, cursor);
+
+    return -1;
+  }
+
+  /* The application still wants to see the layer, but has to compose it. */
+  changed->visible = true;
+  changed->scanout = false;
+
+  return 1;
+}
+
+/* Counterpart to exynos_alloc. */
+static void exynos_free(struct hook_data *data) {
+  /* No more events for the pages from here on. */
+  if (cfg.use_screen == 1 && data->fliphandler)
+    event_thread_stop(data->fliphandler);
+
+  if (cfg.use_screen == 1) {
+    /* Disable/restore the display. */
+    if (drmModeAtomicCommit(data->drm_fd, data->drm->restore_request,
+        DRM_MODE_ATOMIC_ALLOW_MODESET, NULL)) {
+      log_warning("failed to disable/restore the display");
+    }
+  }
+
+  if (data->drm) {
+    unsigned i;
+
+    sprite_destroy(data->drm, data->drm_fd);
+
+    for (i = 0; i < max_layers; ++i) {
+      if (data->drm->layers[i].used)
+        layer_release(data, &data->drm->layers[i]);
+    }
+
+    data->drm->mailbox = NULL;
+    data->drm->flip_page = NULL;
+  }
+
+  clean_up_pages(data->pages, data->num_pages);
+
+  free(data->pages);
+  data->pages = NULL;
+  data->cur_page = NULL;
+
+  exynos_device_destroy(data->device);
+  data->device = NULL;
+}
+
+static uint64_t get_time_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns) {
+  const struct timespec ts = {
+    .tv_sec = ns / 1000000000ull,
+    .tv_nsec = ns % 1000000000ull
+  };
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static drmVBlankSeqType get_vblank_type(const struct exynos_drm *drm, unsigned type) {
+  return (drmVBlankSeqType)(type |
+    ((drm->crtc_index << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK));
+}
+
+/* The config overrides the swap interval of the application. */
+static unsigned get_swap_interval(const struct hook_data *data) {
+  const int interval = __atomic_load_n(&data->swap_interval, __ATOMIC_RELAXED);
+
+  if (cfg.swap_interval != 0)
+    return cfg.swap_interval;
+
+  return (interval > 1) ? interval : 1;
+}
+
+/* Delay the caller until the next flip is due under the fps cap and *
+ * the swap interval. Called once the previous flip has completed.    *
+ * The waiting happens without hook_mutex, so that the event thread  *
+ * and the other entry points aren't blocked meanwhile.              */
+static void pace_flip(struct hook_data *data) {
+  struct exynos_drm *drm = data->drm;
+  const unsigned interval = get_swap_interval(data);
+  const int fd = data->drm_fd;
+  uint64_t deadline = 0;
+  bool wait_vblank = false;
+  drmVBlank vbl = { 0 };
+
+  if (cfg.fps_cap != 0) {
+    const uint64_t period = 1000000000000ull / cfg.fps_cap;
+    const uint64_t now = get_time_ns();
+
+    /* Don't try to catch up after a stall. */
+    if (drm->next_frame_time + period < now)
+      drm->next_frame_time = now;
+    else if (drm->next_frame_time > now)
+      deadline = drm->next_frame_time;
+
+    drm->next_frame_time += period;
+  }
+
+  /* A commit takes effect at the vblank after it was issued. Waiting *
+   * for the vblank before the target keeps the current page on screen *
+   * for the full interval.                                            */
+  if (interval > 1 && data->cur_page != NULL) {
+    vbl.request.type = get_vblank_type(drm, DRM_VBLANK_ABSOLUTE);
+    vbl.request.sequence = data->flip_sequence + interval - 1;
+
+    wait_vblank = true;
+  }
+
+  if (deadline == 0 && !wait_vblank)
+    return;
+
+  pthread_mutex_unlock(&hook_mutex);
+
+  if (deadline != 0)
+    sleep_until(deadline);
+
+  /* Returns right away if the sequence has already passed. */
+  if (wait_vblank && drmWaitVBlank(fd, &vbl) && errno != EINTR)
+    log_warning("failed to wait for vblank");
+
   pthread_mutex_lock(&hook_mutex);
+}
 
-  if (data->initialized == 0)
+/* Front-buffer mode: release the renderer at the configured phase of *
+ * the scanout. With a phase of e.g. 50%, the top half of the page is  *
+ * rendered while the beam scans out the bottom half and vice versa.   *
+ * Like pace_flip(), this sleeps without hook_mutex.                   */
+static void front_buffer_wait(struct hook_data *data) {
+  struct exynos_drm *drm = data->drm;
+  const unsigned refresh = get_mode_refresh(&drm->mode);
+  drmVBlank vbl = { 0 };
+  uint64_t period, target, now;
+
+  if (refresh == 0)
+    return;
+
+  period = 1000000000000ull / refresh;
+
+  /* Waiting for zero vblanks returns the last vblank right away. */
+  vbl.request.type = get_vblank_type(drm, DRM_VBLANK_RELATIVE);
+  vbl.request.sequence = 0;
+
+  if (drmWaitVBlank(data->drm_fd, &vbl)) {
+    log_warning("failed to query vblank");
+    return;
+  }
+
+  target = (uint64_t)vbl.reply.tval_sec * 1000000000ull +
+           (uint64_t)vbl.reply.tval_usec * 1000ull +
+           period * (cfg.scanout_phase % 100) / 100;
+
+  now = get_time_ns();
+  while (target <= now)
+    target += period;
+
+  pthread_mutex_unlock(&hook_mutex);
+  sleep_until(target);
+  pthread_mutex_lock(&hook_mutex);
+}
+
+static unsigned get_active_pages(const struct hook_data *data) {
+  return cfg.adaptive_buffering ? data->drm->adaptive.active_pages : data->num_pages;
+}
+
+/* Choose between double and triple buffering. Double buffering (waiting *
+ * for each flip) has the lowest latency as long as the application keeps *
+ * up with the display, triple buffering absorbs slow frames.             */
+static void update_buffering(struct hook_data *data, uint64_t now) {
+  struct exynos_adaptive *a = &data->drm->adaptive;
+  const uint64_t period = data->refresh_period * get_swap_interval(data);
+  uint64_t busy;
+
+  if (!cfg.adaptive_buffering || a->active_pages == 0 || period == 0)
+    return;
+
+  if (a->last_return != 0 && now > a->last_return) {
+    busy = now - a->last_return;
+
+    if (a->busy_avg == 0)
+      a->busy_avg = busy;
+    else
+      a->busy_avg = a->busy_avg - a->busy_avg / 8 + busy / 8;
+  }
+
+  if (++a->frames < adaptive_window)
+    return;
+
+  if (a->active_pages == 2 && (a->missed > 1 || a->busy_avg > period * 7 / 8)) {
+    a->active_pages = 3;
+    log_info("switching to triple buffering");
+  } else if (a->active_pages == 3 && a->missed == 0 && a->busy_avg < period * 5 / 8) {
+    a->active_pages = 2;
+    log_info("switching to double buffering");
+  }
+
+  a->frames = 0;
+  a->missed = 0;
+}
+
+/* Swap interval 0 tears, but only if the config allows it. */
+static bool flip_immediate(const struct hook_data *data) {
+  return cfg.allow_tearing != 0 && cfg.swap_interval == 0 &&
+         __atomic_load_n(&data->swap_interval, __ATOMIC_RELAXED) == 0;
+}
+
+/* Flip without waiting for the next vblank. While a flip is in flight *
+ * the page is parked instead, and the flip handler commits the newest *
+ * parked page. The caller is never blocked.                           */
+static int exynos_flip_immediate(struct hook_data *data, struct exynos_page *page) {
+  struct exynos_drm *drm = data->drm;
+  const uint32_t flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK |
+                         DRM_MODE_PAGE_FLIP_ASYNC;
+
+  if (data->pageflip_pending > 0) {
+    drm->mailbox = page;
     return 0;
+  }
+
+  /* Async commits may only change the framebuffer. */
+  if (drm->async_flip && !drm->pending_request) {
+    if (drmModeAtomicCommit(data->drm_fd, page->atomic_request, flags, page) == 0) {
+      data->pageflip_pending++;
+      drm->flip_page = page;
+      drm->flip_serial++;
+
+      PROBE2(commit, page->buf_id, data->pageflip_pending);
+      return 0;
+    }
+
+    if (errno != EBUSY) {
+      log_warning("async flip rejected, "
+              "falling back to the next vblank");
+      drm->async_flip = false;
+    }
+  }
+
+  if (commit_flush(data, page)) {
+    log_error("failed to issue atomic page flip");
+    return -1;
+  }
+
+  return 0;
+}
+
+static int exynos_flip(struct hook_data *data, struct exynos_page *page) {
+  struct exynos_drm *drm = data->drm;
+
+  if (data->cur_page != NULL && flip_immediate(data))
+    return exynos_flip_immediate(data, page);
+
+  /* We don't queue multiple page flips. The flag keeps the flip *
+   * handler from committing the pending changes on its own.     */
+  drm->flip_queued = true;
+
+  while (data->pageflip_pending > 0)
+    wait_flip(data);
+
+  pace_flip(data);
+
+  /* Other commits (e.g. of the sprite) may have gone out *
+   * while pace_flip() didn't hold the mutex.             */
+  while (data->pageflip_pending > 0)
+    wait_flip(data);
+
+  drm->flip_queued = false;
+
+  /* This flip supersedes a page parked by an immediate flip. */
+  drm->mailbox = NULL;
+
+  /* Issue a page flip at the next vblank interval. */
+  if (commit_flush(data, page)) {
+    log_error("failed to issue atomic page flip");
+    return -1;
+  }
+
+  /* On startup no frame is displayed. We therefore wait for the initial flip to finish. */
+  if (data->cur_page == NULL) wait_flip(data);
+
+  return 0;
+}
+
+/* Fill the timing fields of the screeninfo from the selected mode.    *
+ * Needs to be called again whenever the mode changes, since clients   *
+ * derive their frame pacing from these values.                        */
+static void update_var_timing(struct hook_data *data) {
+  struct fb_var_screeninfo *var = data->fake_vscreeninfo;
+  const drmModeModeInfo *mode;
+
+  if (!var || !data->drm)
+    return;
+
+  mode = &data->drm->mode;
+
+  /* The pixel clock is specified in picoseconds. */
+  var->pixclock = mode->clock ? (1000000000 + mode->clock / 2) / mode->clock : 0;
+
+  var->left_margin = mode->htotal - mode->hsync_end;
+  var->right_margin = mode->hsync_start - mode->hdisplay;
+  var->upper_margin = mode->vtotal - mode->vsync_end;
+  var->lower_margin = mode->vsync_start - mode->vdisplay;
+  var->hsync_len = mode->hsync_end - mode->hsync_start;
+  var->vsync_len = mode->vsync_end - mode->vsync_start;
+
+  var->sync = 0;
+  if (mode->flags & DRM_MODE_FLAG_PHSYNC)
+    var->sync |= FB_SYNC_HOR_HIGH_ACT;
+  if (mode->flags & DRM_MODE_FLAG_PVSYNC)
+    var->sync |= FB_SYNC_VERT_HIGH_ACT;
+
+  if (mode->flags & DRM_MODE_FLAG_INTERLACE)
+    var->vmode = FB_VMODE_INTERLACED;
+  else if (mode->flags & DRM_MODE_FLAG_DBLSCAN)
+    var->vmode = FB_VMODE_DOUBLE;
+  else
+    var->vmode = FB_VMODE_NONINTERLACED;
+}
+
+/* Number of buffers the application sees. In front-buffer mode *
+ * it double buffers as usual, but both buffers are the page    *
+ * that is scanned out.                                         */
+static unsigned get_num_buffers(const struct hook_data *data) {
+  return cfg.front_buffer ? 2 : data->num_pages;
+}
+
+static struct exynos_page *get_page(struct hook_data *data, unsigned bufidx) {
+  if (bufidx >= get_num_buffers(data))
+    return NULL;
+
+  return &data->pages[cfg.front_buffer ? 0 : bufidx];
+}
+
+/* fbdev counts the rotation clockwise, DRM counter-clockwise. *
+ * Reflection has no fbdev equivalent and isn't reported.       */
+static uint32_t get_var_rotate() {
+  static const uint32_t var_rotate[] = {
+    FB_ROTATE_UR, FB_ROTATE_CCW, FB_ROTATE_UD, FB_ROTATE_CW
+  };
+
+  if (cfg.use_screen == 0 || cfg.rotation > rotation_270)
+    return FB_ROTATE_UR;
+
+  return var_rotate[cfg.rotation];
+}
+
+static void init_var_screeninfo(struct hook_data *data) {
+  if (data->fake_vscreeninfo) return;
+
+  const struct fb_var_screeninfo vscreeninfo = {
+    .xres = data->width,
+    .yres = data->height,
+    .xres_virtual = data->virt_width,
+    .yres_virtual = data->virt_height * get_num_buffers(data),
+    .bits_per_pixel = data->bpp * 8,
+    .red = {
+      .offset = 16,
+      .length = 8
+    },
+    .green = {
+      .offset = 8,
+      .length = 8
+    },
+    .blue = {
+      .offset = 0,
+      .length = 8
+    },
+    .transp = {
+      .offset = 0,
+      .length = 0
+    },
+    .height = 0xffffffff,
+    .width = 0xffffffff,
+    .accel_flags = 1,
+    .rotate = get_var_rotate()
+  };
+
+  data->fake_vscreeninfo = malloc(sizeof(struct fb_var_screeninfo));
+  memcpy(data->fake_vscreeninfo, &vscreeninfo, sizeof(struct fb_var_screeninfo));
+
+  update_var_timing(data);
+}
+
+static void init_fix_screeninfo(struct hook_data *data) {
+  if (data->fake_fscreeninfo) return;
+
+  const struct fb_fix_screeninfo fscreeninfo = {
+    .smem_start = data->base_addr,
+    .smem_len = 0,
+    .visual = FB_VISUAL_TRUECOLOR,
+    .xpanstep = 1,
+    .ypanstep = 1,
+    .line_length = data->pitch
+  };
+
+  data->fake_fscreeninfo = malloc(sizeof(struct fb_fix_screeninfo));
+  memcpy(data->fake_fscreeninfo, &fscreeninfo, sizeof(struct fb_fix_screeninfo));
+}
+
+/* Open the DRM device and select the video mode. */
+static int display_configure(struct hook_data *data) {
+  if (cfg.bpp != 0 && cfg.bpp != 4) {
+    log_error("only bpp=4 supported at the moment");
+    return -1;
+  }
+
+  if (exynos_open(data)) {
+    log_error("opening device failed");
+    return -1;
+  }
+
+  if (exynos_init(data, cfg.bpp != 0 ? cfg.bpp : 4) != 0) {
+    log_error("initialization failed");
+    exynos_close(data);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Allocate the pages and do the initial modeset. *
+ * Tears down the configured display on failure.  */
+static int display_allocate(struct hook_data *data) {
+  if (exynos_alloc(data)) {
+    log_error("allocation failed");
+    exynos_deinit(data);
+    exynos_close(data);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void set_bringup_state(unsigned state) {
+  pthread_mutex_lock(&hook_mutex);
+  bringup.state = state;
+  pthread_cond_broadcast(&bringup.cond);
+  pthread_mutex_unlock(&hook_mutex);
+}
+
+static void *bringup_thread(void *arg) {
+  struct hook_data *data = arg;
+
+  if (display_configure(data)) {
+    set_bringup_state(bringup_failed);
+    return NULL;
+  }
+
+  set_bringup_state(bringup_configured);
+
+  set_bringup_state(display_allocate(data) ? bringup_failed : bringup_ready);
+
+  return NULL;
+}
+
+/* Start the display bring-up in the background, so that it overlaps *
+ * with the initialization the application and the blob do.          */
+static void bringup_start(struct hook_data *data) {
+  pthread_attr_t attr;
+
+  pthread_mutex_lock(&hook_mutex);
+
+  if (data->initialized || bringup.state != bringup_none)
+    goto out;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  bringup.state = bringup_running;
+
+  if (pthread_create(&bringup.thread, &attr, bringup_thread, data)) {
+    log_warning("failed to create thread, initializing synchronously");
+    bringup.state = bringup_none;
+  }
+
+  pthread_attr_destroy(&attr);
+
+out:
+  pthread_mutex_unlock(&hook_mutex);
+}
+
+/* Wait until the bring-up has reached the given state.   *
+ * Returns -1 if it failed. Needs to be called with the   *
+ * hook mutex held.                                       */
+static int bringup_wait(unsigned state) {
+  while (bringup.state != bringup_failed && bringup.state < state)
+    pthread_cond_wait(&bringup.cond, &hook_mutex);
+
+  return (bringup.state == bringup_failed) ? -1 : 0;
+}
+
+static int hook_initialize(struct hook_data *data) {
+  int ret;
+
+  config_load();
+
+  pthread_mutex_lock(&hook_mutex);
+
+  hook_data = data;
+  data->max_frames = cfg.max_frames;
+  data->late_latch = cfg.late_latch;
+  data->latch_margin = (uint64_t)(cfg.latch_margin != 0 ? cfg.latch_margin : 2000) * 1000;
+  data->idle_skip = cfg.idle_skip;
+
+  if (data->initialized) {
+    ret = 0;
+    goto out;
+  }
+
+  if (bringup.state == bringup_none) {
+    if (display_configure(data) || display_allocate(data))
+      goto fail;
+
+    bringup.state = bringup_ready;
+  } else if (bringup_wait(bringup_configured)) {
+    /* Allow a synchronous retry on the next open. */
+    bringup.state = bringup_none;
+    goto fail;
+  }
+
+  /* The screeninfo only depends on the selected mode, so we don't *
+   * wait here for the allocation to finish.                       */
+  data->base_addr = 0x67900000;
+
+  init_var_screeninfo(data);
+  init_fix_screeninfo(data);
+
+  data->initialized = 1;
+
+  ret = 0;
+  goto out;
+
+fail:
+  log_error("display bring-up failed");
+  ret = -1;
+
+out:
+  pthread_mutex_unlock(&hook_mutex);
+
+  return ret;
+}
+
+static int hook_free(struct hook_data *data) {
+  pthread_mutex_lock(&hook_mutex);
+
+  /* A bring-up that is still in progress has to finish first. */
+  bringup_wait(bringup_ready);
+
+  if (data->initialized == 0)
+    goto out;
 
   free(data->fake_vscreeninfo);
   free(data->fake_fscreeninfo);
@@ -1045,51 +2790,120 @@ static int hook_free(struct hook_data *data) {
   data->fake_fscreeninfo = NULL;
   data->base_addr = 0;
 
-  exynos_free(data);
-  exynos_deinit(data);
-  exynos_close(data);
+  /* On failure the bring-up thread already cleaned up. */
+  if (bringup.state == bringup_ready) {
+    exynos_free(data);
+    exynos_deinit(data);
+    exynos_close(data);
+  }
 
   data->initialized = 0;
 
+out:
+  bringup.state = bringup_none;
   pthread_mutex_unlock(&hook_mutex);
 
   return 0;
 }
 
-static int hook_flip(struct hook_data *data, unsigned bufidx) {
+/* Queue the position of the visible area within the page. */
+static int queue_pan(struct hook_data *data, unsigned xoffset, unsigned yoffset) {
+  struct exynos_drm *drm = data->drm;
+
+  if (xoffset == drm->src_x && yoffset == drm->src_y)
+    return 0;
+
+  if (commit_add(drm, drm->primary_plane_id,
+                 drm->properties[plane_prop_src_x].prop_id, (uint64_t)xoffset << 16) ||
+      commit_add(drm, drm->primary_plane_id,
+                 drm->properties[plane_prop_src_y].prop_id, (uint64_t)yoffset << 16))
+    return -1;
+
+  drm->src_x = xoffset;
+  drm->src_y = yoffset;
+
+  return 0;
+}
+
+static int hook_flip(struct hook_data *data, unsigned bufidx,
+                     unsigned xoffset, unsigned yoffset) {
+  struct exynos_page *page;
   int ret;
 
   pthread_mutex_lock(&hook_mutex);
 
-  if (vconf.use_screen == 0) {
+  if (cfg.use_screen == 0) {
     ret = 0;
     goto out;
   }
 
+  if (bringup_wait(bringup_ready)) {
+    ret = -1;
+    goto out;
+  }
+
   assert(data->num_pages != 0);
 
-  switch (data->num_pages) {
+  page = get_page(data, bufidx);
+  if (!page || !page->bo) {
+    ret = -1;
+    goto out;
+  }
+
+  if (queue_pan(data, xoffset, yoffset)) {
+    ret = -1;
+    goto out;
+  }
+
+  /* The single page stays on screen, only the renderer is paced. */
+  if (cfg.front_buffer) {
+    ret = commit_schedule(data);
+    if (ret == 0)
+      front_buffer_wait(data);
+
+    goto out;
+  }
+
+  /* Panning within the displayed page doesn't need a flip. */
+  if (page == data->cur_page && data->pageflip_pending == 0) {
+    ret = commit_schedule(data);
+    goto out;
+  }
+
+  update_buffering(data, get_time_ns());
+
+  switch (get_active_pages(data)) {
     case 1:
       ret = 0;
     break;
 
     case 2:
-      if (exynos_flip(data, &data->pages[bufidx])) {
+      if (exynos_flip(data, page)) {
         ret = -1;
       } else {
-        wait_flip(data->fliphandler);
+        /* Only wait for this flip, not for the commits that the flip *
+         * handler issues afterwards for sprite or layer changes.     */
+        const unsigned serial = data->drm->flip_serial;
+
+        if (!flip_immediate(data)) {
+          while ((int)(serial - data->drm->done_serial) > 0)
+            wait_flip(data);
+        }
+
         ret = 0;
       }
     break;
 
     default: /* three or more pages */
-      if (exynos_flip(data, &data->pages[bufidx]))
+      if (exynos_flip(data, page))
         ret = -1;
       else
         ret = 0;
     break;
   }
 
+  data->drm->adaptive.last_return = get_time_ns();
+
 out:
   pthread_mutex_unlock(&hook_mutex);
 
@@ -1100,24 +2914,506 @@ static int hook_buffer(struct hook_data* data, unsigned bufidx) {
   int fd;
 
   pthread_mutex_lock(&hook_mutex);
-  fd = (bufidx < data->num_pages) ? data->pages[bufidx].fd : -1;
+
+  if (bringup_wait(bringup_ready)) {
+    fd = -1;
+  } else {
+    struct exynos_page *page = get_page(data, bufidx);
+
+    fd = (page && page->bo) ? page->fd : -1;
+
+    if (fd != -1)
+      page->mapped = true;
+  }
+
   pthread_mutex_unlock(&hook_mutex);
 
   return fd;
 }
 
+/* Lock the hook and check that the display is usable for the sprite and the layers. */
+static struct hook_data *sprite_lock() {
+  pthread_mutex_lock(&hook_mutex);
+
+  if (!hook_data || !hook_data->initialized || cfg.use_screen == 0 ||
+      bringup_wait(bringup_ready)) {
+    pthread_mutex_unlock(&hook_mutex);
+    return NULL;
+  }
+
+  return hook_data;
+}
+
+/* Replace the colour calibration. All colour properties change with *
+ * one commit, the parts missing from the calibration are disabled.   */
+static int color_update(struct hook_data *data, const struct color_calibration *cal) {
+  struct exynos_drm *drm = data->drm;
+  const int cursor = drm->pending_request ? drmModeAtomicGetCursor(drm->pending_request) : 0;
+  drmModeAtomicReq *color_request;
+  uint32_t blobs[num_color_props];
+  unsigned i;
+
+  if (color_create_blobs(data->drm_fd, drm, cal, blobs))
+    return -1;
+
+  /* A later modeset (e.g. a flip recovery) has to use the new blobs as well. */
+  color_request = color_create_req(drm, blobs);
+  if (!color_request)
+    goto fail;
+
+  for (i = 0; i < num_color_props; ++i) {
+    const uint32_t prop_id = drm->properties[color_props[i]].prop_id;
+
+    if (prop_id == 0)
+      continue;
+
+    if (commit_add(drm, drm->crtc_id, prop_id, blobs[i])) {
+      if (drm->pending_request)
+        drmModeAtomicSetCursor(drm->pending_request, cursor);
+
+      drmModeAtomicFree(color_request);
+      goto fail;
+    }
+  }
+
+  drmModeAtomicFree(drm->color_request);
+  drm->color_request = color_request;
+
+  /* The committed state keeps its own reference to the old blobs. */
+  color_destroy_blobs(data->drm_fd, drm->color_blobs);
+  memcpy(drm->color_blobs, blobs, sizeof(blobs));
+
+  return commit_schedule(data);
+
+fail:
+  color_destroy_blobs(data->drm_fd, blobs);
+  return -1;
+}
+
+/* Update the image of the sprite. The pixels are in ARGB8888 format. */
+int hook_sprite_update(const uint32_t *argb, unsigned width, unsigned height) {
+  struct hook_data *data;
+  struct exynos_sprite *sprite;
+  unsigned next, y;
+  int cursor, ret = -1;
+
+  if (!argb || width == 0 || height == 0)
+    return -1;
+
+  data = sprite_lock();
+  if (!data)
+    return -1;
+
+  sprite = data->drm->sprite;
+
+  if (sprite && (sprite->width != width || sprite->height != height)) {
+    sprite_destroy(data->drm, data->drm_fd);
+    sprite = NULL;
+  }
+
+  if (!sprite) {
+    if (sprite_create(data, width, height)) {
+      log_error("failed to create %ux%u sprite",
+              width, height);
+      goto out;
+    }
+
+    sprite = data->drm->sprite;
+  } else {
+    /* The other buffer stays on screen until the last update *
+     * has been presented, writing it now would tear.         */
+    while (sprite_busy(data->drm)) {
+      if (data->pageflip_pending > 0)
+        wait_flip(data);
+      else if (commit_schedule(data) || data->pageflip_pending == 0)
+        goto out;
+    }
+
+    /* The mutex was dropped while waiting. */
+    if (data->drm->sprite != sprite)
+      goto out;
+  }
+
+  next = sprite->cur ^ 1;
+  cursor = data->drm->pending_request ? drmModeAtomicGetCursor(data->drm->pending_request) : 0;
+
+  for (y = 0; y < height; ++y) {
+    memcpy((uint8_t *)sprite->bo[next]->vaddr + y * width * 4,
+           argb + y * width, width * 4);
+  }
+
+  sprite->cur = next;
+
+  if (sprite_queue(data)) {
+    if (data->drm->pending_request)
+      drmModeAtomicSetCursor(data->drm->pending_request, cursor);
+
+    sprite->cur = next ^ 1;
+    goto out;
+  }
+
+  sprite->queued = true;
+  ret = commit_schedule(data);
+
+out:
+  pthread_mutex_unlock(&hook_mutex);
+  return ret;
+}
+
+/* Move the sprite. The position is relative to the top-left corner of the screen. */
+int hook_sprite_move(int x, int y) {
+  struct hook_data *data;
+  int ret = -1;
+
+  data = sprite_lock();
+  if (!data)
+    return -1;
+
+  if (data->drm->sprite) {
+    data->drm->sprite->x = x;
+    data->drm->sprite->y = y;
+
+    if (sprite_queue(data) == 0)
+      ret = commit_schedule(data);
+  }
+
+  pthread_mutex_unlock(&hook_mutex);
+  return ret;
+}
+
+int hook_sprite_show(unsigned visible) {
+  struct hook_data *data;
+  int ret = -1;
+
+  data = sprite_lock();
+  if (!data)
+    return -1;
+
+  if (data->drm->sprite) {
+    data->drm->sprite->visible = (visible != 0);
+
+    if (sprite_queue(data) == 0)
+      ret = commit_schedule(data);
+  }
+
+  pthread_mutex_unlock(&hook_mutex);
+  return ret;
+}
+
+static struct exynos_layer *get_layer(struct hook_data *data, int layer) {
+  if (layer < 0 || layer >= max_layers || !data->drm->layers[layer].used)
+    return NULL;
+
+  return &data->drm->layers[layer];
+}
+
+/* Register a dma-buf as a layer. Returns the layer index, *
+ * or a negative value on failure.                         */
+int hook_layer_create(int dmabuf_fd, unsigned width, unsigned height,
+                      unsigned pitch, uint32_t format) {
+  struct hook_data *data;
+  struct exynos_layer *layer = NULL;
+  uint32_t handles[4] = {0}, pitches[4] = {0}, offsets[4] = {0};
+  int ret = -1;
+  unsigned i;
+
+  data = sprite_lock();
+  if (!data)
+    return -1;
+
+  for (i = 0; i < max_layers; ++i) {
+    if (!data->drm->layers[i].used) {
+      layer = &data->drm->layers[i];
+      break;
+    }
+  }
+
+  if (!layer) {
+    log_error("no free layer");
+    goto out;
+  }
+
+  if (drmPrimeFDToHandle(data->drm_fd, dmabuf_fd, &layer->handle)) {
+    log_error("failed to import dma-buf %d", dmabuf_fd);
+    goto out;
+  }
+
+  layer->owns_handle = layer_handle_unused(data, layer);
+
+  handles[0] = layer->handle;
+  pitches[0] = pitch;
+
+  if (drmModeAddFB2(data->drm_fd, width, height, format, handles,
+                    pitches, offsets, &layer->buf_id, 0)) {
+    log_error("failed to add dma-buf %d to fb", dmabuf_fd);
+    layer_release(data, layer);
+    goto out;
+  }
+
+  layer->used = true;
+  layer->width = width;
+  layer->height = height;
+  layer->w = width;
+  layer->h = height;
+  layer->alpha = 0xffff;
+
+  ret = i;
+
+out:
+  pthread_mutex_unlock(&hook_mutex);
+  return ret;
+}
+
+/* Place a layer on the screen. The buffer is scaled to the destination   *
+ * rectangle. Returns 0 if the layer is scanned out by an overlay plane,   *
+ * 1 if the application has to compose the layer itself, or -1 on failure. */
+int hook_layer_set(int layer, int x, int y, unsigned w, unsigned h,
+                   unsigned zpos, unsigned alpha) {
+  struct hook_data *data;
+  struct exynos_layer *l;
+  int ret = -1;
+
+  data = sprite_lock();
+  if (!data)
+    return -1;
+
+  l = get_layer(data, layer);
+  if (l) {
+    l->x = x;
+    l->y = y;
+    l->w = w;
+    l->h = h;
+    l->zpos = zpos;
+    l->alpha = alpha;
+
+    ret = layers_update(data, l);
+    if (ret >= 0 && commit_schedule(data))
+      ret = -1;
+  }
+
+  pthread_mutex_unlock(&hook_mutex);
+  return ret;
+}
+
+/* Show or hide a layer. The return value is the same as for hook_layer_set(). */
+int hook_layer_show(int layer, unsigned visible) {
+  struct hook_data *data;
+  struct exynos_layer *l;
+  int ret = -1;
+
+  data = sprite_lock();
+  if (!data)
+    return -1;
+
+  l = get_layer(data, layer);
+  if (l) {
+    l->visible = (visible != 0);
+
+    ret = layers_update(data, l);
+    if (ret >= 0 && commit_schedule(data))
+      ret = -1;
+  }
+
+  pthread_mutex_unlock(&hook_mutex);
+  return ret;
+}
+
+int hook_layer_destroy(int layer) {
+  struct hook_data *data;
+  struct exynos_layer *l;
+  int ret = -1;
+
+  data = sprite_lock();
+  if (!data)
+    return -1;
+
+  l = get_layer(data, layer);
+  if (l) {
+    /* Take the layer off the screen before releasing its buffer. */
+    if (l->scanout) {
+      l->visible = false;
+
+      if (layers_queue(data) || pending_flush(data))
+        log_warning("failed to disable layer %d", layer);
+    }
+
+    layer_release(data, l);
+    ret = 0;
+  }
+
+  pthread_mutex_unlock(&hook_mutex);
+  return ret;
+}
+
+/* Load a colour calibration file, or disable the colour management if path is NULL. */
+int hook_color_load(const char *path) {
+  struct hook_data *data;
+  struct color_calibration cal = { 0 };
+  int ret;
+
+  if (path && color_load(path, &cal))
+    return -1;
+
+  data = sprite_lock();
+  if (!data) {
+    color_free(&cal);
+    return -1;
+  }
+
+  ret = color_update(data, &cal);
+
+  pthread_mutex_unlock(&hook_mutex);
+
+  color_free(&cal);
+  return ret;
+}
+
+/* Set the colour calibration directly. The matrix is row-major, *
+ * NULL disables the respective part.                            */
+int hook_color_set(const struct drm_color_lut *degamma, unsigned degamma_size,
+                   const double *ctm, const struct drm_color_lut *gamma, unsigned gamma_size) {
+  struct hook_data *data;
+  struct drm_color_ctm matrix;
+  int ret;
+
+  const struct color_calibration cal = {
+    .degamma = (struct drm_color_lut *)degamma,
+    .degamma_size = degamma_size,
+    .ctm = ctm ? &matrix : NULL,
+    .gamma = (struct drm_color_lut *)gamma,
+    .gamma_size = gamma_size
+  };
+
+  if ((degamma && degamma_size < 2) || (gamma && gamma_size < 2))
+    return -1;
+
+  if (ctm)
+    color_ctm_from_matrix(&matrix, ctm);
+
+  data = sprite_lock();
+  if (!data)
+    return -1;
+
+  ret = color_update(data, &cal);
+
+  pthread_mutex_unlock(&hook_mutex);
+  return ret;
+}
+
+/* Release the pages that were never handed out to the blob, e.g. under *
+ * memory pressure. Returns the number of released pages.              *
+ * The fbdev emulation maps the whole framebuffer, so once the blob has *
+ * mapped it, no page is left to release.                              */
+int hook_release_unused() {
+  struct hook_data *data;
+  unsigned i;
+  int count = 0;
+
+  data = sprite_lock();
+  if (!data)
+    return -1;
+
+  for (i = 0; i < data->num_pages; ++i) {
+    struct exynos_page *page = &data->pages[i];
+
+    if (page->mapped || !page->bo || page == data->cur_page ||
+        page == data->drm->mailbox)
+      continue;
+
+    if (page->buf_id != 0)
+      drmModeRmFB(data->drm_fd, page->buf_id);
+
+    close(page->fd);
+    exynos_bo_destroy(page->bo);
+    drmModeAtomicFree(page->atomic_request);
+
+    page->bo = NULL;
+    page->buf_id = 0;
+    page->fd = -1;
+    page->atomic_request = NULL;
+
+    ++count;
+  }
+
+  pthread_mutex_unlock(&hook_mutex);
+
+  if (count != 0)
+    log_info("released %d unused pages", count);
+
+  return count;
+}
+
+/* Set the swap interval, like eglSwapInterval does. */
+int hook_set_swap_interval(unsigned interval) {
+  pthread_mutex_lock(&hook_mutex);
+
+  if (!hook_data) {
+    pthread_mutex_unlock(&hook_mutex);
+    return -1;
+  }
+
+  __atomic_store_n(&hook_data->swap_interval, (int)interval, __ATOMIC_RELAXED);
+
+  pthread_mutex_unlock(&hook_mutex);
+  return 0;
+}
+
+int hook_get_stats(struct hook_stats *stats) {
+  pthread_mutex_lock(&hook_mutex);
+
+  if (!hook_data) {
+    pthread_mutex_unlock(&hook_mutex);
+    return -1;
+  }
+
+  __atomic_load(&hook_data->stats.skipped_frames, &stats->skipped_frames, __ATOMIC_RELAXED);
+  stats->flip_timeouts = hook_data->stats.flip_timeouts;
+  stats->flip_recoveries = hook_data->stats.flip_recoveries;
+  __atomic_load(&hook_data->stats.pp_jobs_in_flight, &stats->pp_jobs_in_flight, __ATOMIC_RELAXED);
+
+  pthread_mutex_unlock(&hook_mutex);
+  return 0;
+}
+
+/* Bracket CPU access to a dma-buf, so that cacheable buffers stay coherent. *
+ * The flags are DMA_BUF_SYNC_{START,END} combined with the access mode.   */
+int hook_dmabuf_sync(int fd, unsigned flags) {
+  struct dma_buf_sync req = { .flags = flags };
+  int ret;
+
+  do {
+    ret = ioctl(fd, DMA_BUF_IOCTL_SYNC, &req);
+  } while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+  return ret;
+}
+
+/* Get the effective video config, including the runtime overrides. */
+const struct video_config *hook_get_config() {
+  config_load();
+
+  return &cfg;
+}
+
 void setup_hook() {
   setupcbfnc setup_hook_callback;
+  struct hook_data *data;
   const char* err;
 
+  config_load();
+
   err = dlerror();
   setup_hook_callback = dlsym(RTLD_DEFAULT, "setup_hook_callback");
   err = dlerror();
 
   if ((err != NULL) || (setup_hook_callback == NULL)) {
-    fprintf(stderr, "dlsym(setup_hook_callback) failed\n");
-    fprintf(stderr, "dlerror = %s\n", err);
+    log_error("dlsym(setup_hook_callback) failed: %s", err ? err : "symbol is NULL");
   } else {
-    setup_hook_callback(hook_initialize, hook_free, hook_flip, hook_buffer);
+    data = setup_hook_callback(hook_initialize, hook_free, hook_flip, hook_buffer);
+
+    if (data) {
+      hook_data = data;
+      bringup_start(data);
+    }
   }
 }
@@ -26,12 +26,15 @@
 #include <GLES2/gl2ext.h>
 
 #include <exynos_drmif.h>
+#include <linux/dma-buf.h>
 
 #include "common.h"
 
 #include <stdlib.h>
 #include <assert.h>
 
+#include <sys/mman.h>
+
 typedef int (*getdrmfbcbfnc)();
 
 /* Some envvars that the blob seems to use:
@@ -98,6 +101,8 @@ const struct video_config vconf = {
 };
 
 extern void setup_hook();
+extern const struct video_config *hook_get_config();
+extern int hook_dmabuf_sync(int fd, unsigned flags);
 
 typedef void GL_APIENTRY (*fncEGLImageTargetRenderbufferStorageOES)(GLenum, GLeglImageOES);
 typedef void GL_APIENTRY (*fncEGLImageTargetTexture2DOES)(GLenum, GLeglImageOES);
@@ -155,7 +160,7 @@ static int dump_egl_surface(EGLDisplay dpy, EGLSurface surf) {
   return 0;
 }
 
-static struct bo_obj* alloc_bo(unsigned bytes) {
+static struct bo_obj* alloc_bo(unsigned bytes, unsigned flags) {
   struct exynos_device *dev;
   struct exynos_bo *bo;
   struct bo_obj* obj;
@@ -188,7 +193,7 @@ static struct bo_obj* alloc_bo(unsigned bytes) {
     return NULL;
   }
 
-  bo = exynos_bo_create(dev, bytes, 0x0);
+  bo = exynos_bo_create(dev, bytes, flags);
   if (!bo)
     goto fail;
 
@@ -230,12 +235,24 @@ static void dump_bo(struct bo_obj *obj) {
 
   assert(obj);
 
-  addr = exynos_bo_map(obj->bo);
-  if (!addr)
+  /* Read through a mapping of the dma-buf itself, the sync below *
+   * isn't guaranteed to cover the GEM mapping of the BO.         */
+  addr = mmap(NULL, obj->bo->size, PROT_READ, MAP_SHARED, obj->fd, 0);
+  if (addr == MAP_FAILED) {
+    fprintf(stderr, "warning: failed to map dma-buf %d\n", obj->fd);
     return;
+  }
+
+  /* The BO is cacheable, so make the GPU writes visible to the CPU first. */
+  if (hook_dmabuf_sync(obj->fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ) < 0)
+    fprintf(stderr, "warning: failed to start CPU access to dma-buf %d\n", obj->fd);
 
   fprintf(stderr, "info: dma-buf %d: pixel[0] = 0x%X\n",
     obj->fd, addr[0]);
+
+  hook_dmabuf_sync(obj->fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+
+  munmap(addr, obj->bo->size);
 }
 
 int pixmap_test(EGLDisplay dpy, EGLContext ctx,
@@ -279,7 +296,7 @@ int pixmap_test(EGLDisplay dpy, EGLContext ctx,
     .format = 0x0
   };
 
-  obj = alloc_bo(pixmap.height * pixmap.width * pixmap.bytes_per_pixel);
+  obj = alloc_bo(pixmap.height * pixmap.width * pixmap.bytes_per_pixel, EXYNOS_BO_CACHABLE);
   if (!obj) {
     fprintf(stderr, "error: buffer object allocation failed\n");
     return -1;
@@ -382,7 +399,7 @@ static int egl_image_test(EGLDisplay dpy) {
     return -1;
   }
 
-  obj = alloc_bo(pixmap.height * pixmap.width * pixmap.bytes_per_pixel);
+  obj = alloc_bo(pixmap.height * pixmap.width * pixmap.bytes_per_pixel, EXYNOS_BO_CACHABLE);
   if (!obj) {
     fprintf(stderr, "error: buffer object allocation failed\n");
     return -2;
@@ -649,8 +666,16 @@ int main(int argc, char* argv[]) {
     fprintf(stderr, "info: EGL configuration ID = 0x%X\n", cfg_id);
   }
 
-  nwin.width = vconf.width;
-  nwin.height = vconf.height;
+  /* The config might have been overridden at runtime. With a rotation *
+   * of 90 or 270 degrees the framebuffer is the display on its side.  */
+  if (hook_get_config()->rotation == rotation_90 ||
+      hook_get_config()->rotation == rotation_270) {
+    nwin.width = hook_get_config()->height;
+    nwin.height = hook_get_config()->width;
+  } else {
+    nwin.width = hook_get_config()->width;
+    nwin.height = hook_get_config()->height;
+  }
 
   fprintf(stderr, "info: calling eglCreateWindowSurface()\n");
   surf = eglCreateWindowSurface(disp, conf, &nwin, NULL);